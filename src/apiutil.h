@@ -45,7 +45,7 @@ enum Notation {
     NOTATION_XIANGQI_WXF,
 };
 
-Notation default_notation(const Variant* v) {
+inline Notation default_notation(const Variant* v) {
     if (v->variantTemplate == "shogi")
         return NOTATION_SHOGI_HODGES_NUMBER;
     return NOTATION_SAN;
@@ -58,11 +58,11 @@ enum Disambiguation {
     SQUARE_DISAMBIGUATION,
 };
 
-bool is_shogi(Notation n) {
+inline bool is_shogi(Notation n) {
     return n == NOTATION_SHOGI_HOSKING || n == NOTATION_SHOGI_HODGES || n == NOTATION_SHOGI_HODGES_NUMBER;
 }
 
-std::string piece(const Position& pos, Move m, Notation n) {
+inline std::string piece(const Position& pos, Move m, Notation n) {
     Color us = pos.side_to_move();
     Square from = from_sq(m);
     Piece pc = pos.moved_piece(m);
@@ -85,7 +85,7 @@ std::string piece(const Position& pos, Move m, Notation n) {
         return std::string(1, toupper(pos.piece_to_char()[pc]));
 }
 
-std::string file(const Position& pos, Square s, Notation n) {
+inline std::string file(const Position& pos, Square s, Notation n) {
     switch (n) {
     case NOTATION_SHOGI_HOSKING:
     case NOTATION_SHOGI_HODGES:
@@ -100,7 +100,7 @@ std::string file(const Position& pos, Square s, Notation n) {
     }
 }
 
-std::string rank(const Position& pos, Square s, Notation n) {
+inline std::string rank(const Position& pos, Square s, Notation n) {
     switch (n) {
     case NOTATION_SHOGI_HOSKING:
     case NOTATION_SHOGI_HODGES_NUMBER:
@@ -123,7 +123,7 @@ std::string rank(const Position& pos, Square s, Notation n) {
     }
 }
 
-std::string square(const Position& pos, Square s, Notation n) {
+inline std::string square(const Position& pos, Square s, Notation n) {
     switch (n) {
     case NOTATION_JANGGI:
         return rank(pos, s, n) + file(pos, s, n);
@@ -132,7 +132,7 @@ std::string square(const Position& pos, Square s, Notation n) {
     }
 }
 
-Disambiguation disambiguation_level(const Position& pos, Move m, Notation n) {
+inline Disambiguation disambiguation_level(const Position& pos, Move m, Notation n) {
     // Drops never need disambiguation
     if (type_of(m) == DROP)
         return NO_DISAMBIGUATION;
@@ -196,7 +196,7 @@ Disambiguation disambiguation_level(const Position& pos, Move m, Notation n) {
         return SQUARE_DISAMBIGUATION;
 }
 
-std::string disambiguation(const Position& pos, Square s, Notation n, Disambiguation d) {
+inline std::string disambiguation(const Position& pos, Square s, Notation n, Disambiguation d) {
     switch (d)
     {
     case FILE_DISAMBIGUATION:
@@ -211,7 +211,7 @@ std::string disambiguation(const Position& pos, Square s, Notation n, Disambigua
     }
 }
 
-const std::string move_to_san(Position& pos, Move m, Notation n) {
+inline const std::string move_to_san(Position& pos, Move m, Notation n) {
     std::string san = "";
     Color us = pos.side_to_move();
     Square from = from_sq(m);
@@ -284,7 +284,7 @@ const std::string move_to_san(Position& pos, Move m, Notation n) {
     return san;
 }
 
-bool hasInsufficientMaterial(Color c, const Position& pos) {
+inline bool hasInsufficientMaterial(Color c, const Position& pos) {
 
     // Other win rules
     if (   pos.captures_to_hand()
@@ -346,18 +346,18 @@ struct CharSquare {
     int rowIdx;
     int fileIdx;
     CharSquare() : rowIdx(-1), fileIdx(-1) {}
-    CharSquare(int rowIdx, int fileIdx) : rowIdx(rowIdx), fileIdx(fileIdx) {}
+    CharSquare(int row, int file) : rowIdx(row), fileIdx(file) {}
 };
 
-bool operator==(const CharSquare& s1, const CharSquare& s2) {
+inline bool operator==(const CharSquare& s1, const CharSquare& s2) {
     return s1.rowIdx == s2.rowIdx && s1.fileIdx == s2.fileIdx;
 }
 
-bool operator!=(const CharSquare& s1, const CharSquare& s2) {
+inline bool operator!=(const CharSquare& s1, const CharSquare& s2) {
     return !(s1 == s2);
 }
 
-int non_root_euclidian_distance(const CharSquare& s1, const CharSquare& s2) {
+inline int non_root_euclidian_distance(const CharSquare& s1, const CharSquare& s2) {
     return pow(s1.rowIdx - s2.rowIdx, 2) + pow(s1.fileIdx - s2.fileIdx, 2);
 }
 
@@ -367,7 +367,7 @@ private:
     int nbFiles;
     std::vector<char> board;  // fill an array where the pieces are for later geometry checks
 public:
-    CharBoard(int nbRanks, int nbFiles) : nbRanks(nbRanks), nbFiles(nbFiles) {
+    CharBoard(int ranks, int files) : nbRanks(ranks), nbFiles(files) {
         assert(nbFiles > 0 && nbRanks > 0);
         board = std::vector<char>(nbRanks * nbFiles, ' ');
     }
@@ -419,7 +419,7 @@ public:
     friend std::ostream& operator<<(std::ostream& os, const CharBoard& board);
 };
 
-std::ostream& operator<<(std::ostream& os, const CharBoard& board) {
+inline std::ostream& operator<<(std::ostream& os, const CharBoard& board) {
     for (int r = 0; r < board.nbRanks; ++r) {
         for (int c = 0; c < board.nbFiles; ++c) {
             os << "[" << board.get_piece(r, c) << "] ";
@@ -429,7 +429,7 @@ std::ostream& operator<<(std::ostream& os, const CharBoard& board) {
     return os;
 }
 
-Validation check_for_valid_characters(const std::string& firstFenPart, const std::string& validSpecialCharacters, const Variant* v) {
+inline Validation check_for_valid_characters(const std::string& firstFenPart, const std::string& validSpecialCharacters, const Variant* v) {
     for (char c : firstFenPart) {
         if (!isdigit(c) && v->pieceToChar.find(c) == std::string::npos && validSpecialCharacters.find(c) == std::string::npos) {
             std::cerr << "Invalid piece character: '" << c << "'." << std::endl;
@@ -439,7 +439,7 @@ Validation check_for_valid_characters(const std::string& firstFenPart, const std
     return OK;
 }
 
-std::vector<std::string> get_fen_parts(const std::string& fullFen, char delim) {
+inline std::vector<std::string> get_fen_parts(const std::string& fullFen, char delim) {
     std::vector<std::string> fenParts;
     std::string curPart;
     std::stringstream ss(fullFen);
@@ -449,7 +449,7 @@ std::vector<std::string> get_fen_parts(const std::string& fullFen, char delim) {
 }
 
 /// fills the character board according to a given FEN string
-Validation fill_char_board(CharBoard& board, const std::string& fenBoard, const std::string& validSpecialCharacters, const Variant* v) {
+inline Validation fill_char_board(CharBoard& board, const std::string& fenBoard, const std::string& validSpecialCharacters, const Variant* v) {
     int rankIdx = 0;
     int fileIdx = 0;
 
@@ -499,7 +499,7 @@ Validation fill_char_board(CharBoard& board, const std::string& fenBoard, const
     return OK;
 }
 
-Validation fill_castling_info_splitted(const std::string& castlingInfo, std::array<std::string, 2>& castlingInfoSplitted) {
+inline Validation fill_castling_info_splitted(const std::string& castlingInfo, std::array<std::string, 2>& castlingInfoSplitted) {
     for (char c : castlingInfo) {
         if (c != '-') {
             if (!isalpha(c)) {
@@ -515,7 +515,7 @@ Validation fill_castling_info_splitted(const std::string& castlingInfo, std::arr
     return OK;
 }
 
-std::string color_to_string(Color c) {
+inline std::string color_to_string(Color c) {
     switch (c) {
     case WHITE:
         return "WHITE";
@@ -528,7 +528,7 @@ std::string color_to_string(Color c) {
     }
 }
 
-Validation check_960_castling(const std::array<std::string, 2>& castlingInfoSplitted, const CharBoard& board, const std::array<CharSquare, 2>& kingPositionsStart) {
+inline Validation check_960_castling(const std::array<std::string, 2>& castlingInfoSplitted, const CharBoard& board, const std::array<CharSquare, 2>& kingPositionsStart) {
 
     for (Color color : {WHITE, BLACK}) {
         for (char charPiece : {'K', 'R'}) {
@@ -546,7 +546,7 @@ Validation check_960_castling(const std::array<std::string, 2>& castlingInfoSpli
     return OK;
 }
 
-std::string castling_rights_to_string(CastlingRights castlingRights) {
+inline std::string castling_rights_to_string(CastlingRights castlingRights) {
     switch (castlingRights) {
     case KING_SIDE:
         return "KING_SIDE";
@@ -573,7 +573,7 @@ std::string castling_rights_to_string(CastlingRights castlingRights) {
     }
 }
 
-Validation check_touching_kings(const CharBoard& board, const std::array<CharSquare, 2>& kingPositions) {
+inline Validation check_touching_kings(const CharBoard& board, const std::array<CharSquare, 2>& kingPositions) {
     if (non_root_euclidian_distance(kingPositions[WHITE], kingPositions[BLACK]) <= 2) {
         std::cerr << "King pieces are next to each other." << std::endl;
         std::cerr << board << std::endl;
@@ -582,7 +582,7 @@ Validation check_touching_kings(const CharBoard& board, const std::array<CharSqu
     return OK;
 }
 
-Validation check_standard_castling(std::array<std::string, 2>& castlingInfoSplitted, const CharBoard& board,
+inline Validation check_standard_castling(std::array<std::string, 2>& castlingInfoSplitted, const CharBoard& board,
                              const std::array<CharSquare, 2>& kingPositions, const std::array<CharSquare, 2>& kingPositionsStart,
                              const std::array<std::vector<CharSquare>, 2>& rookPositionsStart) {
 
@@ -613,7 +613,7 @@ Validation check_standard_castling(std::array<std::string, 2>& castlingInfoSplit
     return OK;
 }
 
-Validation check_pocket_info(const std::string& fenBoard, int nbRanks, const Variant* v, std::array<std::string, 2>& pockets) {
+inline Validation check_pocket_info(const std::string& fenBoard, int nbRanks, const Variant* v, std::array<std::string, 2>& pockets) {
 
     char stopChar;
     int offset = 0;
@@ -653,7 +653,7 @@ Validation check_pocket_info(const std::string& fenBoard, int nbRanks, const Var
     return NOK;
 }
 
-Validation check_number_of_kings(const std::string& fenBoard, const Variant* v) {
+inline Validation check_number_of_kings(const std::string& fenBoard, const Variant* v) {
     int nbWhiteKings = std::count(fenBoard.begin(), fenBoard.end(), toupper(v->pieceToChar[KING]));
     int nbBlackKings = std::count(fenBoard.begin(), fenBoard.end(), tolower(v->pieceToChar[KING]));
 
@@ -668,7 +668,7 @@ Validation check_number_of_kings(const std::string& fenBoard, const Variant* v)
     return OK;
 }
 
-Validation check_en_passant_square(const std::string& enPassantInfo) {
+inline Validation check_en_passant_square(const std::string& enPassantInfo) {
     const char firstChar = enPassantInfo[0];
     if (firstChar != '-') {
         if (enPassantInfo.size() != 2) {
@@ -688,11 +688,11 @@ Validation check_en_passant_square(const std::string& enPassantInfo) {
     return OK;
 }
 
-bool no_king_piece_in_pockets(const std::array<std::string, 2>& pockets) {
+inline bool no_king_piece_in_pockets(const std::array<std::string, 2>& pockets) {
     return pockets[WHITE].find('k') == std::string::npos && pockets[BLACK].find('k') == std::string::npos;
 }
 
-Validation check_digit_field(const std::string& field)
+inline Validation check_digit_field(const std::string& field)
 {
     if (field.size() == 1 && field[0] == '-') {
         return OK;
@@ -705,7 +705,7 @@ Validation check_digit_field(const std::string& field)
 }
 
 
-FenValidation validate_fen(const std::string& fen, const Variant* v) {
+inline FenValidation validate_fen(const std::string& fen, const Variant* v) {
 
     const std::string validSpecialCharacters = "/+~[]-";
     // 0) Layout
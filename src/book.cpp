@@ -0,0 +1,2300 @@
+/*
+  Fairy-Stockfish, a UCI chess variant playing engine derived from Stockfish
+  Copyright (C) 2018-2021 Fabian Fichter
+
+  Fairy-Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Fairy-Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "book.h"
+#include "evaluate.h"
+#include "movegen.h"
+#include "position.h"
+#include "search.h"
+#include "thread.h"
+#include "tt.h"
+#include "uci.h"
+#include "apiutil.h"
+
+using namespace std;
+using Book::BookFile;
+using Book::BookFileWriter;
+using Book::file_key;
+using Book::BookMove;
+using Book::PositionStore;
+using Book::SpillSorter;
+using Book::StreamReader;
+using Book::StreamWriter;
+
+namespace {
+
+  // TaskScheduler distributes tasks over the worker threads. Each worker has
+  // its own deque, where it pushes and pops its tasks at the back, so that it
+  // walks its part of the tree depth-first. Idle workers steal from the front
+  // of the other deques, i.e., they take over the biggest pending subtrees.
+  // In best-first mode, all tasks go into a single heap instead, from which
+  // the workers take the task with the highest priority according to the
+  // operator< of the tasks. The scheduler can be paused to take a consistent
+  // snapshot of the tasks, and closed to hand out no more tasks.
+
+  template<typename T>
+  class TaskScheduler {
+
+    struct Queue {
+      std::mutex mutex;
+      std::deque<T> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::atomic<size_t> pending; // Tasks queued or in progress
+    std::atomic<size_t> active;  // Workers holding a task
+    std::atomic<bool> paused, closed;
+    bool bestFirst;
+
+  public:
+    TaskScheduler(size_t workers, bool best = false)
+      : queues(best ? 1 : workers), pending(0), active(0), paused(false), closed(false), bestFirst(best) {}
+
+    void push(size_t idx, T task) {
+      ++pending;
+      Queue& q = queues[bestFirst ? 0 : idx];
+      std::lock_guard<std::mutex> lk(q.mutex);
+      q.tasks.push_back(std::move(task));
+      if (bestFirst)
+          std::push_heap(q.tasks.begin(), q.tasks.end());
+    }
+
+    // pop() gets the next task for the given worker and returns false when
+    // all the work is done. Every successful pop() must be followed by a call
+    // to done() after the children of the task have been pushed.
+    bool pop(size_t idx, T& task) {
+      while (true)
+      {
+          ++active;
+          for (size_t i = 0; i < queues.size() && !paused && !closed; ++i)
+          {
+              Queue& q = queues[(idx + i) % queues.size()];
+              std::lock_guard<std::mutex> lk(q.mutex);
+              if (!q.tasks.empty())
+              {
+                  if (bestFirst)
+                      std::pop_heap(q.tasks.begin(), q.tasks.end());
+                  if (i == 0)
+                      task = std::move(q.tasks.back()), q.tasks.pop_back();
+                  else
+                      task = std::move(q.tasks.front()), q.tasks.pop_front();
+                  return true;
+              }
+          }
+          --active;
+          if (!pending || closed || Threads.stop)
+              return false;
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+
+    void done() { --pending; --active; }
+
+    // pause() waits until the tasks in progress are done and keeps the workers
+    // from taking new ones until unpause() is called.
+    void pause() {
+      paused = true;
+      while (active)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    void unpause() { paused = false; }
+    void close() { closed = true; }
+
+    // snapshot() returns the pending tasks, the scheduler has to be paused
+    std::vector<T> snapshot() {
+      std::vector<T> tasks;
+      for (Queue& q : queues)
+      {
+          std::lock_guard<std::mutex> lk(q.mutex);
+          tasks.insert(tasks.end(), q.tasks.begin(), q.tasks.end());
+      }
+      return tasks;
+    }
+  };
+
+  // GenTask is a node of the generation tree that still has to be expanded
+  struct GenTask {
+    string fen;
+    Depth depth;
+    Value range;
+    Move hint = MOVE_NONE; // Reply of the parent's PV, searched first
+    Value imbalance = VALUE_ZERO; // Distance of the parent's score for it from the bias
+
+    // The priority in best-first mode, the closer to the bias the better,
+    // and then the closer to the root the better
+    bool operator<(const GenTask& t) const {
+      return imbalance != t.imbalance ? imbalance > t.imbalance : depth < t.depth;
+    }
+  };
+
+  // GenMemo remembers the nodes of the generation tree that have already been
+  // expanded, so that transpositions into the same node with the same depth
+  // are only searched once. Since the leaves are always at the given depth
+  // below a node, a subtree can only be reused for exactly the same depth,
+  // but it covers any range up to the one it was expanded with.
+  class GenMemo {
+
+    std::mutex mutex;
+    std::vector<std::unordered_map<Key, Value>> expanded; // Indexed by depth
+
+  public:
+    explicit GenMemo(Depth maxDepth) : expanded(maxDepth + 1) {}
+
+    // visit() returns whether the node still needs to be expanded
+    bool visit(Key key, Depth depth, Value range) {
+      std::lock_guard<std::mutex> lk(mutex);
+      auto it = expanded[depth].find(key);
+      if (it != expanded[depth].end() && it->second >= range)
+          return false;
+      expanded[depth][key] = range;
+      return true;
+    }
+
+    void save(ostream& out) {
+      std::lock_guard<std::mutex> lk(mutex);
+      for (size_t d = 0; d < expanded.size(); ++d)
+          for (const auto& e : expanded[d])
+              out << "memo " << d << ' ' << e.first << ' ' << e.second << '\n';
+    }
+  };
+
+  // key_path() returns the file that keeps the keys of the streamed positions
+  // for the checkpoints, or an empty string without checkpoints.
+  string key_path() {
+    string path = Options["CheckpointPath"];
+    return path.empty() || path == "<empty>" ? "" : path + ".keys";
+  }
+
+  // EpdWriter streams the positions to the EPD file while they are produced,
+  // so that the book does not have to be kept in memory and the output of an
+  // interrupted run is not lost. The workers only append to a buffer, which
+  // a background thread writes out and flushes. Duplicates are dropped by key.
+  class EpdWriter {
+
+    static constexpr size_t BufferSize = 1 << 20;
+
+    std::ofstream file, keyFile;
+    std::mutex mutex, fileMutex; // Always locked in this order
+    std::condition_variable cv;
+    string buffer;
+    std::unordered_set<Key> written;
+    vector<Key> unsaved; // Written since the last checkpoint
+    bool checkpoints;
+    size_t appended = 0;
+    bool exit = false;
+    std::thread writer;
+
+    void loop() {
+      string out;
+      std::unique_lock<std::mutex> lk(mutex);
+      while (!exit || !buffer.empty())
+      {
+          cv.wait_for(lk, std::chrono::seconds(1), [&]{ return exit || buffer.size() >= BufferSize; });
+          out.swap(buffer);
+          std::unique_lock<std::mutex> flk(fileMutex);
+          lk.unlock();
+          file << out << std::flush;
+          out.clear();
+          flk.unlock();
+          lk.lock();
+      }
+    }
+
+  public:
+    // The writer either starts a new file or, when resuming, continues the
+    // file after dropping whatever was written after the checkpoint. The same
+    // holds for the keys, which are read back to drop the duplicates.
+    explicit EpdWriter(const string& path, std::streamoff resumeAt = -1, std::streamoff keysAt = -1)
+      : checkpoints(!key_path().empty()) {
+      if (resumeAt >= 0)
+      {
+          std::error_code ec;
+          std::filesystem::resize_file(path, uintmax_t(resumeAt), ec);
+          file.open(path, ios::app);
+      }
+      else
+          file.open(path);
+      if (checkpoints && keysAt >= 0)
+      {
+          std::error_code ec;
+          std::filesystem::resize_file(key_path(), uintmax_t(keysAt), ec);
+          ifstream keys(key_path());
+          Key key;
+          while (keys >> key)
+              written.insert(key);
+          keyFile.open(key_path(), ios::app);
+      }
+      else if (checkpoints)
+          keyFile.open(key_path());
+      writer = std::thread(&EpdWriter::loop, this);
+    }
+
+    ~EpdWriter() {
+      {
+          std::lock_guard<std::mutex> lk(mutex);
+          exit = true;
+      }
+      cv.notify_one();
+      writer.join();
+    }
+
+    void write(Key key, const string& fen) {
+      std::lock_guard<std::mutex> lk(mutex);
+      if (written.insert(key).second)
+      {
+          if (checkpoints)
+              unsaved.push_back(key);
+          buffer += fen;
+          buffer += '\n';
+          if (buffer.size() >= BufferSize)
+              cv.notify_one();
+      }
+    }
+
+    // append() writes a position that is known to be new, e.g., from a merge
+    // of unique positions, without keeping its key.
+    void append(const string& fen) {
+      std::lock_guard<std::mutex> lk(mutex);
+      buffer += fen;
+      buffer += '\n';
+      ++appended;
+      if (buffer.size() >= BufferSize)
+          cv.notify_one();
+    }
+
+    size_t size() {
+      std::lock_guard<std::mutex> lk(mutex);
+      return written.size() + appended;
+    }
+
+    // checkpoint() writes out the buffer and saves the file length. Only the
+    // keys written since the last checkpoint are appended to the key file,
+    // whose length is saved, too. If they cannot be written, the checkpoint
+    // fails.
+    void checkpoint(ostream& out) {
+      std::lock_guard<std::mutex> lk(mutex);
+      std::lock_guard<std::mutex> flk(fileMutex);
+      file << buffer << std::flush;
+      buffer.clear();
+      for (Key key : unsaved)
+          keyFile << key << '\n';
+      keyFile << std::flush;
+      unsaved.clear();
+      out << "stream " << std::streamoff(file.tellp()) << ' ' << std::streamoff(keyFile.tellp()) << '\n';
+      if (!file || !keyFile)
+          out.setstate(ios::failbit);
+    }
+  };
+
+  // option_value() returns the current value of an option as set by the GUI
+  string option_value(const UCI::Option& o) {
+    string type = o.get_type();
+    return type == "spin"  ? std::to_string(int(o))
+         : type == "check" ? (bool(o) ? "true" : "false")
+                           : string(o);
+  }
+
+  // save_checkpoint() saves the options, the command and the state of the job
+  // to the checkpoint file. The file is replaced only after it was written.
+  void save_checkpoint(const string& path, const string& command, const std::function<void(ostream&)>& state) {
+
+    string tmpPath = path + ".tmp";
+    ofstream file(tmpPath);
+
+    // The variants have to be loaded before the variant is selected
+    file << "setoption name VariantPath value " << option_value(Options["VariantPath"]) << '\n';
+    for (const auto& it : Options)
+        if (it.second.get_type() != "button" && it.first != "VariantPath")
+            file << "setoption name " << it.first << " value " << option_value(it.second) << '\n';
+
+    file << "command " << command << '\n';
+    state(file);
+    file.close();
+
+    if (file)
+    {
+        std::remove(path.c_str());
+        std::rename(tmpPath.c_str(), path.c_str());
+    }
+    else
+        sync_cout << "info string Failed to write checkpoint " << tmpPath << sync_endl;
+  }
+
+  // save_position() writes a position of the book to the checkpoint, preceded
+  // by its analysis, if any, which Book::resume() stores with the position.
+  void save_position(ostream& out, Key key, const string& fen, const Book::Analysis* a) {
+    if (a && !a->lines.empty())
+    {
+        out << "analysis " << a->depth << ' ' << a->nodes << ' ' << int(a->sideToMove);
+        for (const auto& line : a->lines)
+            out << ' ' << int(line.first) << ' ' << int(line.second);
+        out << '\n';
+        if (a->classifyRange != VALUE_NONE)
+            out << "classified " << a->classifyRange << '\n';
+    }
+    out << "position " << key << ' ' << fen << '\n';
+  }
+
+  // Progress counts the work of the running book command for the periodic
+  // progress reports. The commands reset it and count the processed and the
+  // accepted positions, while the searches are counted by analyse(). The
+  // commands may give an estimate of the remaining time.
+  struct Progress {
+    std::atomic<uint64_t> processed, accepted, searches, nodes;
+    std::atomic<int> depth;
+    TimePoint start, lastReport;
+    std::function<double()> remaining; // In seconds, negative if unknown
+
+    void reset() {
+      processed = accepted = searches = nodes = 0;
+      depth = 0;
+      start = lastReport = now();
+      remaining = nullptr;
+    }
+
+    void report() {
+      lastReport = now();
+      TimePoint elapsed = std::max(now() - start, TimePoint(1));
+      std::ostringstream ss;
+      ss << "info string progress processed " << processed << " accepted " << accepted
+         << " searches " << searches << " sps " << searches * 1000 / elapsed
+         << " nps " << nodes * 1000 / elapsed << " hashfull " << TT.hashfull();
+      if (depth)
+          ss << " depth " << depth;
+      double eta = remaining ? remaining() : -1;
+      ss << " time " << elapsed / 1000 << "s";
+      if (eta >= 0)
+          ss << " eta " << uint64_t(eta) << "s";
+      sync_cout << ss.str() << sync_endl;
+    }
+  };
+
+  Progress progress;
+
+  // run_reported() runs the job on the workers and reports the progress every
+  // ProgressInterval seconds. It is used by the jobs without checkpoints, which
+  // may consist of several runs, e.g., one per level.
+  void run_reported(const std::function<void(Thread&)>& job) {
+
+    TimePoint interval = TimePoint(Options["ProgressInterval"]) * 1000;
+    if (!interval)
+    {
+        Threads.run_workers(job);
+        return;
+    }
+
+    Threads.run_workers(job, [&]{
+        if (now() - progress.lastReport >= interval)
+            progress.report();
+    }, interval);
+  }
+
+  // run_checkpointed() runs the job on the workers. If a CheckpointPath is set,
+  // the state of the job is saved every CheckpointInterval seconds, and the
+  // checkpoint is removed again once the job is completed. The progress is
+  // reported every ProgressInterval seconds and at the end.
+  void run_checkpointed(const std::function<void(Thread&)>& job, const string& command,
+                        const std::function<void(ostream&)>& state) {
+
+    string path = Options["CheckpointPath"];
+    bool checkpoints = !path.empty() && path != "<empty>";
+    TimePoint checkpointInterval = checkpoints ? TimePoint(Options["CheckpointInterval"]) * 1000 : 0;
+    TimePoint progressInterval = TimePoint(Options["ProgressInterval"]) * 1000;
+
+    if (!checkpointInterval && !progressInterval)
+    {
+        Threads.run_workers(job);
+        return;
+    }
+
+    // The monitor runs at the shorter of the intervals
+    TimePoint lastCheckpoint = now();
+    Threads.run_workers(job, [&]{
+        if (checkpointInterval && now() - lastCheckpoint >= checkpointInterval)
+        {
+            save_checkpoint(path, command, state);
+            lastCheckpoint = now();
+        }
+        if (progressInterval && now() - progress.lastReport >= progressInterval)
+            progress.report();
+    }, std::min(checkpointInterval ? checkpointInterval : progressInterval,
+                progressInterval ? progressInterval : checkpointInterval));
+
+    if (progressInterval)
+        progress.report();
+
+    if (checkpoints && !Threads.stop)
+    {
+        std::remove(path.c_str());
+        std::remove(key_path().c_str());
+    }
+  }
+
+  // book_key() identifies a position in the book. Other than Position::key()
+  // it does not depend on the 50-move counter, and it includes the gating
+  // rights, which are not part of the Zobrist key.
+  Key book_key(const Position& pos) {
+    Key key = pos.key();
+    if (pos.rule50_count() >= 14)
+        key ^= make_key((pos.rule50_count() - 14) / 8);
+    if (pos.seirawan_gating())
+        for (Color c : { WHITE, BLACK })
+        {
+            Bitboard b = pos.gates(c);
+            while (b)
+                key ^= make_key(c * SQUARE_NB + pop_lsb(&b) + 1);
+        }
+    return key;
+  }
+
+  string book_fen(const Position& pos, bool trim) {
+    string fen = pos.fen();
+    if (trim)
+        fen.erase(fen.rfind(" ", fen.rfind(" ") - 1));
+    return fen;
+  }
+
+  // fnv_hash() is a hash function for strings that is stable across platforms
+  Key fnv_hash(const string& s) {
+    Key h = 14695981039346656037ULL;
+    for (unsigned char c : s)
+        h = (h ^ c) * 1099511628211ULL;
+    return h;
+  }
+
+  // open_cache() opens the analysis cache given by the AnalysisCache option.
+  // Its context key covers the variant, the search limits and the options
+  // that change the results of the book searches.
+  std::unique_ptr<Book::AnalysisCache> open_cache(const Search::LimitsType& limits) {
+
+    string path = Options["AnalysisCache"];
+    if (path.empty() || path == "<empty>")
+        return nullptr;
+
+    std::ostringstream ss;
+    ss << string(Options["UCI_Variant"]) << ' ' << bool(Options["UCI_Chess960"])
+       << ' ' << limits.depth << ' ' << limits.nodes << ' ' << limits.movetime
+       << ' ' << int(Options["MultiPV"]) << ' ' << int(Options["Contempt"])
+       << ' ' << bool(Options["Use NNUE"]) << ' ' << string(Options["EvalFile"])
+       << ' ' << int(Options["PrepassDepth"]) << ' ' << int(Options["PrepassMargin"]);
+
+    std::unique_ptr<Book::AnalysisCache> cache(new Book::AnalysisCache(path, fnv_hash(ss.str())));
+    if (!cache->is_open())
+    {
+        sync_cout << "info string " << path << " is no analysis cache of this version, not using it" << sync_endl;
+        return nullptr;
+    }
+    return cache;
+  }
+
+  // line_range() returns the range for the MultiPV lines needed to judge the
+  // moves within the given range of the best one. Absolute move scores need
+  // all the lines.
+  Value line_range(Value range) {
+    return Options["AbsMoveScore"] ? VALUE_INFINITE : range;
+  }
+
+  // covers() checks whether the analysis has all the lines within the range
+  // of the best one. A range-bounded search stops after the first line that
+  // is out of its range, so it does not cover wider ranges. A classification
+  // only covers its own range.
+  bool covers(const Book::Analysis& a, Value range, const Variant* v, const string& fen, Thread* th) {
+
+    if (a.classifyRange != VALUE_NONE && a.classifyRange != range)
+        return false;
+
+    if (   a.lines.size() >= size_t(Options["MultiPV"])
+        || (!a.lines.empty() && a.lines.front().second - a.lines.back().second > range))
+        return true;
+
+    StateInfo st;
+    Position pos;
+    pos.set(v, fen, Options["UCI_Chess960"], &st, th);
+    return a.lines.size() >= MoveList<LEGAL>(pos).size();
+  }
+
+  // analyse() returns the analysis of the given position, either from the
+  // cache or from a search by the given worker. Only the lines within the
+  // range of the best one, plus the first one out of it, are searched. With
+  // the classify limit, these lines only have bounds instead of exact scores.
+  // The hint is searched first, and the replies of the PVs are returned for
+  // searched positions if requested.
+  Book::Analysis analyse(Thread& th, const Variant* v, Key key, const string& fen,
+                         const Search::LimitsType& limits, Value range, Book::AnalysisCache* cache,
+                         Move hint = MOVE_NONE, vector<Move>* replies = nullptr) {
+
+    Book::Analysis a;
+    range = line_range(range);
+
+    // Classified analyses only hold for their range, so they are cached
+    // under a key of their own.
+    Value classifyRange = limits.classify && range < VALUE_INFINITE ? range : VALUE_NONE;
+    if (classifyRange != VALUE_NONE)
+        key ^= fnv_hash("classify " + std::to_string(range));
+
+    if (cache && cache->probe(key, a))
+    {
+        a.classifyRange = classifyRange;
+        if (covers(a, range, v, fen, &th))
+            return a;
+    }
+    a = Book::Analysis();
+
+    Search::LimitsType bounded = limits;
+    bounded.pvRange = range;
+    bounded.firstMove = hint;
+
+    // A shallow pre-pass over all the root moves drops the ones that are far
+    // out of the range, so the deep search only has to look at the others.
+    // The best of the dropped moves is kept as an out of range line.
+    Depth prepass = int(Options["PrepassDepth"]);
+    std::pair<Move, Value> dropped(MOVE_NONE, VALUE_NONE);
+    uint64_t prepassNodes = 0;
+
+    if (prepass > 0 && range < VALUE_INFINITE && (!limits.depth || prepass < limits.depth))
+    {
+        Search::LimitsType shallow;
+        shallow.depth = prepass;
+        shallow.multiPV = MAX_MOVES;
+        shallow.pvRange = range + int(Options["PrepassMargin"]) * PawnValueEg / 100;
+        shallow.firstMove = hint;
+        th.search_position(v, fen, shallow);
+        prepassNodes = th.nodes;
+
+        const Search::RootMoves& rootMoves = th.rootMoves;
+        if (th.pvCount < rootMoves.size())
+        {
+            for (size_t i = 0; i + 1 < th.pvCount; ++i)
+                bounded.searchmoves.push_back(rootMoves[i].pv[0]);
+            dropped = {rootMoves[th.pvCount - 1].pv[0], rootMoves[th.pvCount - 1].score};
+        }
+    }
+
+    th.search_position(v, fen, bounded);
+
+    // The lines after the current PV line still have the scores of the
+    // previous iteration if the search was stopped.
+    const Search::RootMoves& rootMoves = th.rootMoves;
+    size_t multiPV = std::min({(size_t)Options["MultiPV"], th.pvCount, rootMoves.size()});
+
+    a.depth = th.completedDepth;
+    a.nodes = th.nodes + prepassNodes;
+    a.sideToMove = th.rootPos.side_to_move();
+    a.classifyRange = classifyRange;
+    for (size_t i = 0; i < multiPV; ++i)
+    {
+        a.lines.emplace_back(rootMoves[i].pv[0], i <= th.pvIdx ? rootMoves[i].score
+                                                               : rootMoves[i].previousScore);
+        if (replies)
+            replies->push_back(rootMoves[i].pv.size() > 1 ? rootMoves[i].pv[1] : MOVE_NONE);
+    }
+
+    if (   dropped.first != MOVE_NONE
+        && a.lines.size() < size_t(Options["MultiPV"])
+        && a.lines.front().second - a.lines.back().second <= range)
+        a.lines.emplace_back(dropped.first, std::min(dropped.second, a.lines.front().second - range - 1));
+
+    ++progress.searches;
+    progress.nodes += a.nodes;
+
+    if (cache)
+        cache->store(key, a);
+    return a;
+  }
+
+  // good_moves() returns the moves of the analysis that are within the range
+  // of the best move or the target score.
+  vector<Move> good_moves(const Book::Analysis& a, Value range) {
+
+    vector<Move> moves;
+
+    Value bias = int(Options["AbsScoreBias"]) * PawnValueEg / 100;
+    bool abs_move_score = Options["AbsMoveScore"];
+    Color us = a.sideToMove;
+
+    Value v0 = VALUE_ZERO;
+
+    for (size_t i = 0; i < a.lines.size(); ++i)
+    {
+        Value v = a.lines[i].second;
+        if (i == 0)
+            v0 = v;
+
+        if (abs_move_score ? std::abs((us == WHITE ? v : -v) - bias) <= range
+                           : v0 - v <= range)
+            moves.push_back(a.lines[i].first);
+    }
+
+    return moves;
+  }
+
+  // is_balanced() checks whether the analysis shows a balanced position where
+  // all the MultiPV moves are within the range. The margin widens the ranges
+  // for less precise analyses.
+  bool is_balanced(const Book::Analysis& a, Value margin = VALUE_ZERO) {
+
+    Value range         = int(Options["MoveScoreRange"]) * PawnValueEg / 100 + margin;
+    Value abs_range     = int(Options["AbsScoreRange"])  * PawnValueEg / 100 + margin;
+    Value bias          = int(Options["AbsScoreBias"])   * PawnValueEg / 100;
+    bool abs_move_score = int(Options["AbsMoveScore"]);
+    Color us = a.sideToMove;
+
+    Value v0 = VALUE_ZERO;
+
+    for (size_t i = 0; i < a.lines.size(); ++i)
+    {
+        Value v = a.lines[i].second;
+        if (i == 0)
+        {
+            if (std::abs((us == WHITE ? v : -v) - bias) > abs_range)
+                return false;
+            v0 = v;
+        }
+        else if (abs_move_score ? std::abs((us == WHITE ? v : -v) - bias) > range
+                                : v0 - v > range)
+            return false;
+    }
+
+    return true;
+  }
+
+  // epd_fen() extracts the FEN from a line of an EPD or FEN file, where fields
+  // is the number of FEN fields of the variant. Missing move counters, like in
+  // EPD, are replaced by default ones. The EPD operations are returned in ops.
+  string epd_fen(const string& line, size_t fields, string& ops) {
+
+    istringstream ss(line);
+    vector<string> tokens;
+    string token, fen;
+
+    while (ss >> token)
+        tokens.push_back(token);
+
+    if (tokens.size() + 2 < fields)
+        return "";
+
+    for (size_t i = 0; i + 2 < fields; ++i)
+        fen += (i ? " " : "") + tokens[i];
+
+    size_t next = fields - 2;
+    auto is_number = [&](size_t i) {
+        return i < tokens.size() && tokens[i].find_first_not_of("0123456789") == string::npos;
+    };
+    if (is_number(next) && is_number(next + 1))
+        fen += " " + tokens[next] + " " + tokens[next + 1], next += 2;
+    else
+        fen += " 0 1";
+
+    ops.clear();
+    for (size_t i = next; i < tokens.size(); ++i)
+        ops += (i > next ? " " : "") + tokens[i];
+
+    return fen;
+  }
+
+  // fen_with_counters() adds default move counters to a trimmed book FEN
+  string fen_with_counters(const string& fen, const Variant* v) {
+    string ops;
+    return epd_fen(fen, std::count(v->startFen.begin(), v->startFen.end(), ' ') + 1, ops);
+  }
+
+  // EPD scores are in centipawns, mate scores are 32767 minus the plies to mate.
+  // from_cp() rounds away from zero, so that to_cp() restores the centipawns.
+  int to_cp(Value v) {
+    return  std::abs(v) < VALUE_MATE_IN_MAX_PLY ? v * 100 / PawnValueEg
+          : v > 0 ? 32767 - (VALUE_MATE - v) : -32767 + (VALUE_MATE + v);
+  }
+
+  Value from_cp(int cp) {
+    return  std::abs(cp) <= 32767 - MAX_PLY ? Value((cp * PawnValueEg + (cp > 0 ? 99 : cp < 0 ? -99 : 0)) / 100)
+          : cp > 0 ? VALUE_MATE - (32767 - cp) : -VALUE_MATE + (32767 + cp);
+  }
+
+  // epd_line() appends the analysis as EPD operations to the FEN: the
+  // evaluation (ce), the depth (acd), the nodes (acn), the best move (bm) and
+  // the MultiPV lines as UCI moves with their evaluations (mpv). The bounds of
+  // a classification are no evaluations, so it is not appended.
+  string epd_line(const string& fen, const Book::Analysis& a, const Variant* v, Thread* th) {
+
+    std::ostringstream ss;
+    ss << fen;
+    if (a.lines.empty() || a.classifyRange != VALUE_NONE)
+        return ss.str();
+
+    StateInfo st;
+    Position pos;
+    pos.set(v, fen_with_counters(fen, v), Options["UCI_Chess960"], &st, th);
+
+    ss << " ce " << to_cp(a.lines[0].second) << ";"
+       << " acd " << a.depth << ";"
+       << " acn " << a.nodes << ";";
+    if (a.lines[0].first != MOVE_NONE)
+        ss << " bm " << move_to_san(pos, a.lines[0].first, default_notation(v)) << ";";
+    ss << " mpv";
+    for (const auto& line : a.lines)
+        ss << ' ' << UCI::move(pos, line.first) << ':' << to_cp(line.second);
+    ss << ";";
+
+    return ss.str();
+  }
+
+  // epd_analysis() parses the EPD operations written by epd_line()
+  bool epd_analysis(const string& ops, Position& pos, Book::Analysis& a) {
+
+    istringstream ss(ops);
+    string opcode, operand;
+    bool found = false;
+
+    a = Book::Analysis();
+    a.sideToMove = pos.side_to_move();
+
+    while (ss >> opcode)
+    {
+        vector<string> operands;
+        while (ss >> operand && operand != ";")
+        {
+            bool last = operand.back() == ';';
+            if (last)
+                operand.pop_back();
+            operands.push_back(operand);
+            if (last)
+                break;
+        }
+        if (!opcode.empty() && opcode.back() == ';')
+            opcode.pop_back();
+
+        int cp;
+        if (opcode == "ce" && operands.size() == 1 && a.lines.empty())
+        {
+            if (!(istringstream(operands[0]) >> cp))
+                return false;
+            a.lines.emplace_back(MOVE_NONE, from_cp(cp));
+            found = true;
+        }
+        else if (opcode == "acd" && operands.size() == 1)
+            istringstream(operands[0]) >> a.depth;
+        else if (opcode == "acn" && operands.size() == 1)
+            istringstream(operands[0]) >> a.nodes;
+        else if (opcode == "mpv" && !operands.empty())
+        {
+            a.lines.clear();
+            for (string& op : operands)
+            {
+                size_t colon = op.rfind(':');
+                string move = op.substr(0, colon);
+                if (colon == string::npos || !(istringstream(op.substr(colon + 1)) >> cp))
+                    return false;
+                a.lines.emplace_back(UCI::to_move(pos, move), from_cp(cp));
+            }
+            found = true;
+        }
+    }
+
+    return found;
+  }
+
+  // has_token() checks whether the command contains the given token, and
+  // token_value() returns the number following it, if any. These are for the
+  // options of the book commands that are not search limits.
+  bool has_token(const string& command, const string& name) {
+
+    istringstream ss(command);
+    string token;
+    while (ss >> token)
+        if (token == name)
+            return true;
+    return false;
+  }
+
+  int64_t token_value(const string& command, const string& name, int64_t def) {
+
+    istringstream ss(command);
+    string token;
+    while (ss >> token)
+        if (token == name)
+            ss >> def;
+    return def;
+  }
+
+  // Shard is the part of the work of a process given by the "shard i/N" token
+  // of a command. Positions are assigned to the shards by their book file
+  // keys, which do not depend on the build, so that processes on different
+  // machines need no coordination. The low bits of the FNV-1a keys of similar
+  // FENs are strongly correlated, so the keys are mixed (murmur3 fmix64) first.
+  struct Shard {
+    uint64_t index = 0, count = 1;
+
+    bool owns(const Position& pos) const {
+      if (count == 1)
+          return true;
+      uint64_t k = Book::file_key(pos);
+      k ^= k >> 33;
+      k *= 0xFF51AFD7ED558CCDULL;
+      k ^= k >> 33;
+      k *= 0xC4CEB9FE1A85EC53ULL;
+      k ^= k >> 33;
+      return k % count == index;
+    }
+  };
+
+  Shard read_shard(const string& command) {
+
+    istringstream ss(command);
+    string token;
+    Shard shard;
+    char slash;
+    while (ss >> token)
+        if (token == "shard")
+        {
+            uint64_t index, count;
+            if (ss >> index >> slash >> count && slash == '/' && index < count)
+                shard.index = index, shard.count = count;
+        }
+    return shard;
+  }
+
+  // Sharded generation splits the tree at this ply, the upper plies are
+  // expanded by every shard.
+  constexpr Depth ShardPly = 2;
+
+  // multipv_gen() expands the tree of good moves from the given tasks. The
+  // subtrees are independent of each other, so they are distributed as tasks
+  // over the threads, each of which searches its nodes on its own. In
+  // best-first mode the nodes closest to balance are expanded first, so that
+  // the book holds the most balanced positions found so far when generation
+  // stops at the optional budget of positions.
+
+  void multipv_gen(const Variant* variant, const Search::LimitsType& limits, const vector<GenTask>& tasks,
+                   GenMemo& memo, PositionStore& book, EpdWriter* stream, const string& command) {
+
+    bool trim = Options["TrimFEN"];
+    bool chess960 = Options["UCI_Chess960"];
+    int depthFactor = int(Options["DepthFactor"]);
+    Value bias = int(Options["AbsScoreBias"]) * PawnValueEg / 100;
+    size_t budget = size_t(token_value(command, "positions", 0));
+    Shard shard = read_shard(command);
+    Depth rootDepth;
+    string token;
+    istringstream(command) >> token >> rootDepth;
+    Depth shardDepth = std::max(rootDepth - ShardPly, 0);
+    std::mutex bookMutex;
+    auto cache = open_cache(limits);
+
+    // The nodes per remaining depth for the estimate of the remaining time,
+    // where the subtrees of the pending nodes are projected with the
+    // branching factors observed so far.
+    Depth maxDepth = rootDepth;
+    for (const GenTask& task : tasks)
+        maxDepth = std::max(maxDepth, task.depth);
+    vector<std::atomic<uint64_t>> pending(maxDepth + 1), expanded(maxDepth + 1), children(maxDepth + 1);
+
+    progress.reset();
+    progress.remaining = [&]() {
+        uint64_t total = 0, totalChildren = 0;
+        for (Depth d = 2; d <= maxDepth; ++d)
+            total += expanded[d], totalChildren += children[d];
+        TimePoint elapsed = now() - progress.start;
+        if (!total || !progress.processed || !elapsed)
+            return -1.0;
+
+        double cost = 1, work = double(pending[1]);
+        for (Depth d = 2; d <= maxDepth; ++d)
+        {
+            double b = expanded[d] ? double(children[d]) / expanded[d] : double(totalChildren) / total;
+            cost = 1 + b * cost;
+            work += pending[d] * cost;
+        }
+        return work * elapsed / progress.processed / 1000;
+    };
+
+    TaskScheduler<GenTask> scheduler(Threads.size(), has_token(command, "bestfirst"));
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        ++pending[tasks[i].depth];
+        scheduler.push(i % Threads.size(), tasks[i]);
+    }
+
+    auto job = [&](Thread& th) {
+
+        GenTask task;
+        while (scheduler.pop(th.id(), task))
+        {
+            StateInfo rootState;
+            Position rootPos;
+            rootPos.set(variant, task.fen, chess960, &rootState, &th);
+
+            // A single legal move is within the range of the best move by
+            // definition, so it needs no search, unless the moves are judged
+            // by their absolute scores. The same holds at the last depth for
+            // the hint if the range is zero, since then only the best move
+            // leads to a leaf, and the parent's PV already decided which one
+            // it is (moves tied with it are not kept then). Otherwise the
+            // children are searched with the replies of the PVs as hints.
+            vector<Move> moves, replies;
+            MoveList<LEGAL> legal(rootPos);
+            Book::Analysis a;
+
+            if (legal.size() == 1 && !Options["AbsMoveScore"])
+                moves.push_back(*legal.begin());
+            else if (   task.depth == 1 && task.range <= 0 && legal.contains(task.hint)
+                     && !Options["AbsMoveScore"])
+                moves.push_back(task.hint);
+            else
+            {
+                a = analyse(th, variant, book_key(rootPos), task.fen, limits, task.range, cache.get(),
+                            task.hint, task.depth > 1 ? &replies : nullptr);
+                moves = good_moves(a, task.range);
+            }
+
+            for (Move m : moves)
+            {
+                StateInfo st;
+                rootPos.do_move(m, st);
+                if (task.depth - 1 == shardDepth && !shard.owns(rootPos))
+                {
+                    rootPos.undo_move(m);
+                    continue;
+                }
+                if (task.depth <= 1)
+                {
+                    string fen = book_fen(rootPos, trim);
+                    size_t count;
+                    if (stream)
+                    {
+                        stream->write(book_key(rootPos), fen);
+                        count = stream->size();
+                    }
+                    else
+                    {
+                        std::lock_guard<std::mutex> lk(bookMutex);
+                        book.insert(variant, book_key(rootPos), fen);
+                        count = book.size();
+                    }
+                    progress.accepted = count;
+
+                    // Tasks in progress are still completed, so the budget
+                    // can be exceeded slightly
+                    if (budget && count >= budget)
+                        scheduler.close();
+                }
+                else
+                {
+                    Value childRange = task.range * depthFactor / 100;
+                    Move hint = MOVE_NONE;
+                    Value imbalance = task.imbalance;
+                    for (size_t i = 0; i < a.lines.size(); ++i)
+                        if (a.lines[i].first == m)
+                        {
+                            Value v = a.lines[i].second;
+                            imbalance = Value(std::abs((a.sideToMove == WHITE ? v : -v) - bias));
+                            if (i < replies.size())
+                                hint = replies[i];
+                        }
+                    if (memo.visit(book_key(rootPos), task.depth - 1, childRange))
+                    {
+                        ++pending[task.depth - 1];
+                        ++children[task.depth];
+                        scheduler.push(th.id(), GenTask{rootPos.fen(), task.depth - 1, childRange, hint, imbalance});
+                    }
+                }
+                rootPos.undo_move(m);
+            }
+
+            --pending[task.depth];
+            ++expanded[task.depth];
+            ++progress.processed;
+            progress.depth = std::max(int(progress.depth), rootDepth - task.depth + 1);
+            scheduler.done();
+        }
+    };
+
+    // Without tasks in progress, the pending tasks and the positions found so
+    // far are exactly the remaining and the completed work.
+    run_checkpointed(job, command, [&](ostream& out) {
+
+        scheduler.pause();
+
+        for (const GenTask& task : scheduler.snapshot())
+            out << "task " << task.depth << ' ' << task.range << ' ' << task.imbalance << ' '
+                << int(task.hint) << ' ' << task.fen << '\n';
+        memo.save(out);
+        Book::Analysis a;
+        for (size_t i = 0; i < book.size(); ++i)
+            save_position(out, book.key(i), book.fen(i), book.analysis(i, a) ? &a : nullptr);
+        if (stream)
+            stream->checkpoint(out);
+
+        scheduler.unpause();
+    });
+
+    progress.remaining = nullptr;
+  }
+
+  // eval_balanced() checks whether the static evaluation of the position is
+  // within the range of the bias. The evaluation is meaningless in check, so
+  // such positions always pass.
+  bool eval_balanced(Thread& th, const Variant* v, const string& fen, Value range, Value bias) {
+
+    StateInfo st;
+    Position pos;
+    pos.set(v, fen, Options["UCI_Chess960"], &st, &th);
+    if (pos.checkers())
+        return true;
+
+    Value e = Eval::evaluate(pos);
+    return std::abs((pos.side_to_move() == WHITE ? e : -e) - bias) <= range;
+  }
+
+  // filter_job() searches the positions of the book for which no decision has
+  // been made yet. Before the search, the positions can pass through cheaper
+  // stages, a static evaluation and a shallow search, with their own ranges,
+  // where each stage only sees the positions that passed the previous one.
+  // The "eval" mode only compares the static evaluation with AbsScoreRange.
+  // Each position is evaluated on its own by Eval::evaluate(), there is no
+  // batched inference, but the positions are handed out in chunks to save on
+  // the synchronization.
+  // Every worker takes the next open position and stores its
+  // decision by index, so the result neither depends on how the positions are
+  // spread over the workers nor on the order in which they finish. Note that
+  // the workers share the TT and keep their histories between positions,
+  // which can still slightly influence the scores.
+
+  enum Decision : char { OPEN, REJECTED, ACCEPTED };
+
+  void filter_job(const Search::LimitsType& limits, PositionStore& book, const string& decisions,
+                  EpdWriter* stream, const string& command) {
+
+    const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+    Value range = int(Options["MoveScoreRange"]) * PawnValueEg / 100;
+    vector<std::atomic<char>> decision(book.size());
+    std::atomic<size_t> next(0);
+    bool evalOnly = has_token(command, "eval");
+    auto cache = evalOnly ? nullptr : open_cache(limits);
+    bool annotate = Options["EPDAnnotations"] && !evalOnly;
+    vector<Book::Analysis> notes(annotate ? book.size() : 0);
+
+    Value evalRange   = int(Options["FilterEvalRange"]) * PawnValueEg / 100;
+    Value bias        = int(Options["AbsScoreBias"]) * PawnValueEg / 100;
+    Value margin      = int(Options["FilterShallowMargin"]) * PawnValueEg / 100;
+    Search::LimitsType shallow;
+    shallow.depth = int(Options["FilterShallowDepth"]);
+    std::atomic<size_t> rejected[3] = {};
+
+    // The analyses of the positions accepted before a resume are in the book
+    for (size_t i = 0; i < decisions.size() && i < book.size(); ++i)
+        if ((decision[i] = decisions[i] - '0') == ACCEPTED && annotate)
+            book.analysis(i, notes[i]);
+
+    // The positions of the other shards are dropped
+    Shard shard = read_shard(command);
+    if (shard.count > 1)
+        for (size_t i = 0; i < book.size(); ++i)
+            if (decision[i] == OPEN)
+            {
+                StateInfo st;
+                Position pos;
+                pos.set(variant, fen_with_counters(book.fen(i), variant), Options["UCI_Chess960"], &st, Threads.main());
+                if (!shard.owns(pos))
+                    decision[i] = REJECTED;
+            }
+
+    size_t open = std::count(decision.begin(), decision.end(), OPEN);
+    progress.reset();
+    progress.remaining = [&]() {
+        TimePoint elapsed = now() - progress.start;
+        return progress.processed ? double(open - progress.processed) * elapsed / progress.processed / 1000 : -1.0;
+    };
+
+    auto eval_job = [&](Thread& th) {
+
+        constexpr size_t ChunkSize = 1024;
+        Value absRange = int(Options["AbsScoreRange"]) * PawnValueEg / 100;
+
+        for (size_t c = next.fetch_add(ChunkSize); c < book.size() && !Threads.stop; c = next.fetch_add(ChunkSize))
+            for (size_t i = c; i < std::min(c + ChunkSize, book.size()); ++i)
+            {
+                if (decision[i] != OPEN)
+                    continue;
+
+                string fen = book.fen(i);
+                bool keep = eval_balanced(th, variant, fen, absRange, bias);
+                if (keep && stream)
+                    stream->write(book.key(i), fen);
+                decision[i] = keep ? ACCEPTED : REJECTED;
+                ++progress.processed;
+                progress.accepted += keep;
+            }
+    };
+
+    auto job = [&](Thread& th) {
+
+        for (size_t i = next++; i < book.size() && !Threads.stop; i = next++)
+        {
+            if (decision[i] != OPEN)
+                continue;
+
+            string fen = book.fen(i);
+
+            if (evalRange && !eval_balanced(th, variant, fen, evalRange, bias))
+            {
+                decision[i] = REJECTED;
+                ++rejected[0];
+                ++progress.processed;
+                continue;
+            }
+
+            if (   shallow.depth
+                && !is_balanced(analyse(th, variant, book.key(i), fen, shallow, range + margin, nullptr), margin))
+            {
+                decision[i] = REJECTED;
+                ++rejected[1];
+                ++progress.processed;
+                continue;
+            }
+
+            Book::Analysis a = analyse(th, variant, book.key(i), fen, limits, range, cache.get());
+            bool keep = is_balanced(a);
+            rejected[2] += !keep;
+            ++progress.processed;
+            progress.accepted += keep;
+            if (keep && stream)
+                stream->write(book.key(i), annotate ? epd_line(fen, a, variant, &th) : fen);
+            if (keep && annotate)
+                notes[i] = std::move(a);
+            decision[i] = keep ? ACCEPTED : REJECTED;
+        }
+    };
+
+    // The decisions are saved before the stream, so every accepted position
+    // is also in the saved part of the stream.
+    // The analyses of the accepted positions are only complete once their
+    // decisions are, so the decisions are taken before the positions.
+    run_checkpointed(evalOnly ? std::function<void(Thread&)>(eval_job) : job, command, [&](ostream& out) {
+
+        string decided(book.size(), '0');
+        for (size_t i = 0; i < book.size(); ++i)
+            decided[i] += decision[i];
+
+        Book::Analysis a;
+        for (size_t i = 0; i < book.size(); ++i)
+            save_position(out, book.key(i), book.fen(i),
+                            annotate && decided[i] == '0' + ACCEPTED && !notes[i].lines.empty() ? &notes[i]
+                          : book.analysis(i, a) ? &a : nullptr);
+        out << "decisions " << decided << '\n';
+        if (stream)
+            stream->checkpoint(out);
+    });
+
+    progress.remaining = nullptr;
+
+    if (!evalOnly && (evalRange || shallow.depth))
+        sync_cout << "info string rejected by evaluation " << rejected[0]
+                  << " shallow search " << rejected[1] << " search " << rejected[2] << sync_endl;
+
+    vector<char> keep(book.size());
+    for (size_t i = 0; i < book.size(); ++i)
+        keep[i] = decision[i] == ACCEPTED;
+
+    // The analyses make the payloads grow, so the book has to be rebuilt
+    if (annotate)
+    {
+        PositionStore annotated;
+        for (size_t i = 0; i < book.size(); ++i)
+            if (keep[i])
+                annotated.insert(variant, book.key(i), book.fen(i), notes[i].lines.empty() ? nullptr : &notes[i]);
+        book = std::move(annotated);
+    }
+    else
+        book.retain(keep);
+  }
+
+  // read_limits() parses the search limits of the book commands
+  Search::LimitsType read_limits(istringstream& is) {
+
+    Search::LimitsType limits;
+    string token;
+
+    while (is >> token)
+        if (token == "depth")          is >> limits.depth;
+        else if (token == "nodes")     is >> limits.nodes;
+        else if (token == "movetime")  is >> limits.movetime;
+        else if (token == "perft")     limits.perft = 1;
+        else if (token == "classify")  limits.classify = 1;
+
+    return limits;
+  }
+
+  // perft_spill_gen() is perft_gen() for levels that may not fit into the
+  // BookMemory. Each level is collected by a SpillSorter, and the merge that
+  // deduplicates it feeds the workers with chunks of positions to expand.
+  // The leaves are merged into the EPD file, or else into the book. It returns
+  // false if the runs could not be written or read, in which case positions
+  // are missing.
+
+  bool perft_spill_gen(const Variant* variant, const string& rootFen, Depth depth, size_t budget,
+                       const Shard& shard, PositionStore& book, EpdWriter* stream) {
+
+    bool trim = Options["TrimFEN"];
+    bool chess960 = Options["UCI_Chess960"];
+    string dir = Options["SpillPath"] == "<empty>" ? "" : string(Options["SpillPath"]);
+
+    // The budget is shared by the level being merged and the one being collected
+    std::unique_ptr<SpillSorter> level(new SpillSorter(variant, budget / 2, dir));
+    {
+        StateInfo st;
+        Position pos;
+        pos.set(variant, rootFen, chess960, &st, Threads.main());
+        level->add(book_key(pos), rootFen);
+    }
+
+    for (Depth d = 1; d <= depth; ++d)
+    {
+        bool leaves = d == depth;
+        std::unique_ptr<SpillSorter> next(new SpillSorter(variant, budget / 2, dir));
+        std::mutex nextMutex;
+        vector<string> chunk;
+
+        progress.depth = d;
+
+        auto expand = [&]() {
+            std::atomic<size_t> idx(0);
+
+            run_reported([&](Thread& th) {
+
+                vector<std::pair<Key, string>> batch;
+                StateInfo st, st2;
+                Position pos;
+
+                auto flush = [&]() {
+                    std::lock_guard<std::mutex> lk(nextMutex);
+                    for (const auto& p : batch)
+                        next->add(p.first, p.second);
+                    batch.clear();
+                };
+
+                for (size_t i = idx++; i < chunk.size(); i = idx++)
+                {
+                    ++progress.processed;
+                    pos.set(variant, chunk[i], chess960, &st, &th);
+                    for (const auto& m : MoveList<LEGAL>(pos))
+                    {
+                        pos.do_move(m, st2);
+                        if (d != std::min(depth, ShardPly) || shard.owns(pos))
+                            batch.emplace_back(book_key(pos), leaves ? book_fen(pos, trim) : pos.fen());
+                        pos.undo_move(m);
+                    }
+                    if (batch.size() >= 1024)
+                        flush();
+                }
+                flush();
+            });
+
+            chunk.clear();
+        };
+
+        size_t count = level->merge([&](Key, const string& fen) {
+            chunk.push_back(fen);
+            if (chunk.size() >= 65536)
+                expand();
+        });
+        expand();
+
+        if (!level->good() || !next->good())
+            return false;
+
+        if (d > 1)
+            sync_cout << "info string perft depth " << d - 1 << " positions " << count << sync_endl;
+
+        level = std::move(next);
+    }
+
+    if (level->run_count())
+        sync_cout << "info string merging " << level->run_count() << " runs" << sync_endl;
+
+    level->merge([&](Key key, const string& fen) {
+        if (stream)
+            stream->append(fen);
+        else
+            book.insert(variant, key, fen);
+        ++progress.accepted;
+    });
+
+    return level->good();
+  }
+
+  // perft_gen() adds all the positions at the given depth to the book. The tree
+  // is enumerated level by level and every level is deduplicated before it is
+  // expanded, so each position is only expanded once, however many move
+  // sequences lead to it. Each level is expanded by all the workers. With a
+  // BookMemory budget, the levels are deduplicated by external merging. It
+  // returns false if the generation failed.
+
+  bool perft_gen(const Variant* variant, const string& rootFen, Depth depth, const Shard& shard,
+                 PositionStore& book, EpdWriter* stream) {
+
+    bool trim = Options["TrimFEN"];
+    bool chess960 = Options["UCI_Chess960"];
+    PositionStore level;
+    progress.reset();
+
+    {
+        StateInfo st;
+        Position pos;
+        pos.set(variant, rootFen, chess960, &st, Threads.main());
+        if (depth < 1)
+        {
+            if (stream)
+                stream->write(book_key(pos), book_fen(pos, trim));
+            else
+                book.insert(variant, book_key(pos), book_fen(pos, trim));
+            return true;
+        }
+        level.insert(variant, book_key(pos), rootFen);
+    }
+
+    if (int(Options["BookMemory"]))
+    {
+        if (perft_spill_gen(variant, rootFen, depth, size_t(int(Options["BookMemory"])) << 20, shard, book, stream))
+            return true;
+        sync_cout << "info string Could not write or read the spilled runs, generation aborted" << sync_endl;
+        return false;
+    }
+
+    size_t previousSize = 0;
+
+    for (Depth d = 1; d <= depth; ++d)
+    {
+        // The last level goes into the book, with the FEN trimmed as configured
+        bool leaves = d == depth;
+        PositionStore next;
+        std::mutex nextMutex;
+        std::atomic<size_t> idx(0);
+
+        // The remaining levels are projected with the branching factor of the
+        // previous level, where every position costs the same
+        double branching = previousSize ? double(level.size()) / previousSize : 0;
+        uint64_t levelStart = progress.processed;
+        size_t levelSize = level.size();
+        progress.depth = d;
+        progress.remaining = [=]() {
+            if (!branching || !progress.processed)
+                return -1.0;
+            double work = double(levelSize) - double(progress.processed - levelStart), size = double(levelSize);
+            for (Depth r = d + 1; r <= depth; ++r)
+                work += size *= branching;
+            return work * (now() - progress.start) / progress.processed / 1000;
+        };
+
+        run_reported([&](Thread& th) {
+
+            vector<std::pair<Key, string>> batch;
+            StateInfo st, st2;
+            Position pos;
+
+            auto flush = [&]() {
+                if (leaves && stream)
+                {
+                    for (const auto& p : batch)
+                        stream->write(p.first, p.second);
+                    progress.accepted = stream->size();
+                }
+                else
+                {
+                    std::lock_guard<std::mutex> lk(nextMutex);
+                    for (const auto& p : batch)
+                        (leaves ? book : next).insert(variant, p.first, p.second);
+                    if (leaves)
+                        progress.accepted = book.size();
+                }
+                batch.clear();
+            };
+
+            for (size_t i = idx++; i < level.size(); i = idx++)
+            {
+                ++progress.processed;
+                pos.set(variant, level.fen(i), chess960, &st, &th);
+                for (const auto& m : MoveList<LEGAL>(pos))
+                {
+                    pos.do_move(m, st2);
+                    if (d != std::min(depth, ShardPly) || shard.owns(pos))
+                        batch.emplace_back(book_key(pos), leaves ? book_fen(pos, trim) : pos.fen());
+                    pos.undo_move(m);
+                }
+                if (batch.size() >= 1024)
+                    flush();
+            }
+            flush();
+        });
+
+        if (!leaves)
+            sync_cout << "info string perft depth " << d << " positions " << next.size() << sync_endl;
+
+        previousSize = level.size();
+        level = std::move(next);
+    }
+
+    progress.remaining = nullptr;
+    return true;
+  }
+
+  // beam_gen() expands the tree of good moves level by level, but only keeps
+  // the best nodes of each level, i.e., the ones whose scores are closest to
+  // the bias, or a uniform sample of them. The leaves are capped by the
+  // position limit. Before each level is expanded, the number of positions
+  // and the time the remaining levels will take are projected from the
+  // branching factor, so that a run that is too large can be stopped early.
+
+  void beam_gen(const Variant* variant, const string& rootFen, Depth depth, const Search::LimitsType& limits,
+                size_t width, bool sample, size_t maxPositions, PositionStore& book, EpdWriter* stream) {
+
+    struct Node {
+      Value imbalance;
+      Key key;
+      string fen;
+    };
+
+    bool trim = Options["TrimFEN"];
+    bool chess960 = Options["UCI_Chess960"];
+    int depthFactor = int(Options["DepthFactor"]);
+    Value range = int(Options["MoveScoreRange"]) * PawnValueEg / 100;
+    Value bias  = int(Options["AbsScoreBias"])   * PawnValueEg / 100;
+    auto cache = open_cache(limits);
+    PRNG rng(1070372);
+    TimePoint start = now();
+    size_t expanded = 0;
+    double work = 0; // Projected nodes to expand from the current level on
+    double branching; // Of the previous level
+    progress.reset();
+
+    vector<Node> level;
+    {
+        StateInfo st;
+        Position pos;
+        pos.set(variant, rootFen, chess960, &st, Threads.main());
+        level.push_back({VALUE_ZERO, book_key(pos), rootFen});
+
+        // The legal moves bound the branching factor of the first level
+        branching = double(MoveList<LEGAL>(pos).size());
+    }
+
+    for (Depth d = 1; d <= depth && !Threads.stop; ++d)
+    {
+        bool leaves = d == depth;
+
+        // Assume that the branching factor stays the same for the remaining
+        // levels, where each expanded node costs as much as the ones so far.
+        double projected = double(level.size());
+        work = 0;
+        for (Depth r = d; r <= depth; ++r)
+        {
+            work += projected;
+            projected = std::min(projected * branching, double(r < depth ? width : std::min(width, maxPositions)));
+        }
+
+        TimePoint elapsed = now() - start;
+        sync_cout << "info string beam depth " << d << " nodes " << level.size()
+                  << " branching " << branching << " projected positions " << size_t(projected)
+                  << (expanded ? " time " + std::to_string(size_t(work * elapsed / expanded / 1000)) + "s" : "")
+                  << sync_endl;
+
+        vector<Node> next;
+        std::mutex nextMutex;
+        std::atomic<size_t> idx(0);
+
+        uint64_t levelStart = progress.processed;
+        progress.depth = d;
+        progress.remaining = [=]() {
+            if (!progress.processed)
+                return -1.0;
+            double rest = std::max(work - double(progress.processed - levelStart), 0.0);
+            return rest * (now() - progress.start) / progress.processed / 1000;
+        };
+
+        run_reported([&](Thread& th) {
+
+            for (size_t i = idx++; i < level.size() && !Threads.stop; i = idx++)
+            {
+                StateInfo st, st2;
+                Position pos;
+                pos.set(variant, level[i].fen, chess960, &st, &th);
+
+                Book::Analysis a = analyse(th, variant, level[i].key, level[i].fen, limits, range, cache.get());
+                ++progress.processed;
+                vector<Node> children;
+                for (Move m : good_moves(a, range))
+                {
+                    Value v = std::find_if(a.lines.begin(), a.lines.end(),
+                                           [m](const std::pair<Move, Value>& l) { return l.first == m; })->second;
+                    pos.do_move(m, st2);
+                    children.push_back({Value(std::abs((a.sideToMove == WHITE ? v : -v) - bias)),
+                                        book_key(pos), leaves ? book_fen(pos, trim) : pos.fen()});
+                    pos.undo_move(m);
+                }
+
+                std::lock_guard<std::mutex> lk(nextMutex);
+                next.insert(next.end(), children.begin(), children.end());
+            }
+        });
+
+        if (Threads.stop)
+            break;
+
+        expanded += level.size();
+        range = range * depthFactor / 100;
+
+        // Sort by key first, so that the selection does not depend on the
+        // order in which the workers finish, and merge transpositions.
+        std::sort(next.begin(), next.end(), [](const Node& n1, const Node& n2) {
+            return n1.key != n2.key ? n1.key < n2.key : n1.imbalance < n2.imbalance;
+        });
+        next.erase(std::unique(next.begin(), next.end(), [](const Node& n1, const Node& n2) {
+            return n1.key == n2.key;
+        }), next.end());
+
+        branching = level.empty() ? 0 : double(next.size()) / level.size();
+        size_t keep = std::min(next.size(), leaves ? std::min(width, maxPositions) : width);
+
+        if (sample)
+            for (size_t i = 0; i < keep; ++i)
+                std::swap(next[i], next[i + rng.rand<uint64_t>() % (next.size() - i)]);
+        else
+            std::stable_sort(next.begin(), next.end(), [](const Node& n1, const Node& n2) {
+                return n1.imbalance < n2.imbalance;
+            });
+        next.resize(keep);
+
+        level = std::move(next);
+    }
+
+    progress.remaining = nullptr;
+
+    if (Threads.stop)
+        return;
+
+    for (const Node& n : level)
+        if (stream)
+            stream->write(n.key, n.fen);
+        else
+            book.insert(variant, n.key, n.fen);
+    progress.accepted = level.size();
+  }
+
+  // random_gen() samples positions by random walks of the given number of
+  // plies. With search limits, each move is drawn from the good moves of a
+  // search, weighted by the closeness of their scores to the best one, and
+  // otherwise uniformly from the legal moves. The endpoints are kept if their
+  // static evaluation is within the AbsScoreRange of the bias. The walks stop
+  // at the requested number of positions, or after a hundred walks per
+  // requested position, e.g., for trees smaller than that.
+
+  void random_gen(const Variant* variant, const string& rootFen, Depth depth, const Search::LimitsType& limits,
+                  size_t count, uint64_t seed, PositionStore& book, EpdWriter* stream) {
+
+    bool trim = Options["TrimFEN"];
+    bool chess960 = Options["UCI_Chess960"];
+    bool weighted = limits.depth || limits.nodes || limits.movetime;
+    Value range    = int(Options["MoveScoreRange"]) * PawnValueEg / 100;
+    Value absRange = int(Options["AbsScoreRange"])  * PawnValueEg / 100;
+    Value bias     = int(Options["AbsScoreBias"])   * PawnValueEg / 100;
+    std::mutex bookMutex;
+    std::atomic<size_t> found(0), walks(0);
+    size_t maxWalks = 100 * count;
+    TimePoint start = now();
+
+    // The walks are expected to find positions at the rate so far, until
+    // they run out
+    progress.reset();
+    progress.depth = depth;
+    progress.remaining = [&]() {
+        if (!progress.accepted)
+            return -1.0;
+        double rest = std::min(double(count - progress.accepted) * progress.processed / progress.accepted,
+                               double(maxWalks - std::min(uint64_t(maxWalks), uint64_t(progress.processed))));
+        return rest * (now() - progress.start) / progress.processed / 1000;
+    };
+
+    run_reported([&](Thread& th) {
+
+        PRNG rng(seed + 0x9E3779B97F4A7C15ULL * (th.id() + 1));
+        vector<std::pair<Key, string>> batch;
+        std::deque<StateInfo> states;
+        Position pos;
+
+        // The batches of the workers are cut off at the requested number
+        auto flush = [&]() {
+            std::lock_guard<std::mutex> lk(bookMutex);
+            for (const auto& p : batch)
+            {
+                if (found >= count)
+                    break;
+                if (stream)
+                    stream->write(p.first, p.second), found = stream->size();
+                else
+                    book.insert(variant, p.first, p.second), found = book.size();
+            }
+            progress.accepted = size_t(found);
+            batch.clear();
+        };
+
+        while (found < count && walks++ < maxWalks && !Threads.stop)
+        {
+            ++progress.processed;
+            states.clear();
+            states.emplace_back();
+            pos.set(variant, rootFen, chess960, &states.back(), &th);
+
+            Depth ply = 0;
+            for ( ; ply < depth; ++ply)
+            {
+                MoveList<LEGAL> legal(pos);
+                if (!legal.size())
+                    break;
+
+                Move m = *(legal.begin() + rng.rand<uint64_t>() % legal.size());
+                if (weighted && legal.size() > 1)
+                {
+                    string fen = pos.fen();
+                    Book::Analysis a = analyse(th, variant, book_key(pos), fen, limits, range, nullptr);
+                    if (a.lines.empty())
+                        break;
+                    vector<uint64_t> weights;
+                    uint64_t total = 0;
+                    for (const auto& l : a.lines)
+                    {
+                        Value diff = a.lines[0].second - l.second;
+                        weights.push_back(diff <= range ? uint64_t(range - diff + 1) : 0);
+                        total += weights.back();
+                    }
+                    uint64_t r = rng.rand<uint64_t>() % total;
+                    size_t i = 0;
+                    while (r >= weights[i])
+                        r -= weights[i++];
+                    m = a.lines[i].first;
+                }
+
+                states.emplace_back();
+                pos.do_move(m, states.back());
+            }
+
+            if (ply < depth || !MoveList<LEGAL>(pos).size())
+                continue;
+
+            if (eval_balanced(th, variant, pos.fen(), absRange, bias))
+                batch.emplace_back(book_key(pos), book_fen(pos, trim));
+            if (batch.size() >= 256)
+                flush();
+        }
+        flush();
+    });
+
+    progress.remaining = nullptr;
+
+    sync_cout << "info string random walks " << std::min(size_t(walks), maxWalks) << " positions " << size_t(found)
+              << " time " << (now() - start) / 1000 << "s" << sync_endl;
+  }
+
+} // namespace
+
+
+/// Book::generate() is called when the engine receives the "generate" command.
+/// It adds the positions at the given depth of the tree of good moves (or of
+/// all legal moves in perft mode) from the current position to the book. With
+/// StreamEPD the positions are written to the EPD file instead.
+
+void Book::generate(Position& pos, istringstream& is, PositionStore& book) {
+
+  Depth depth;
+  is >> depth;
+  Search::LimitsType limits = read_limits(is);
+
+  std::unique_ptr<EpdWriter> stream;
+  if (Options["StreamEPD"])
+      stream.reset(new EpdWriter(Options["EPDPath"]));
+
+  size_t width = size_t(token_value(is.str(), "beam", 0));
+  size_t count = size_t(token_value(is.str(), "random", 0));
+
+  if (limits.perft)
+  {
+      if (!perft_gen(pos.variant(), pos.fen(), depth, read_shard(is.str()), book, stream.get()))
+          return;
+  }
+  else if (count)
+      random_gen(pos.variant(), pos.fen(), depth, limits, count,
+                 uint64_t(token_value(is.str(), "seed", 1070372)), book, stream.get());
+  else if (width)
+      beam_gen(pos.variant(), pos.fen(), depth, limits, width, has_token(is.str(), "sample"),
+               size_t(token_value(is.str(), "positions", int64_t(width))), book, stream.get());
+  else
+  {
+      Value range = int(Options["MoveScoreRange"]) * PawnValueEg / 100;
+      GenMemo memo(depth);
+      multipv_gen(pos.variant(), limits, {GenTask{pos.fen(), depth, range}}, memo, book, stream.get(), is.str());
+  }
+
+  // The final report of multipv_gen() is made with its checkpoints
+  if ((limits.perft || count || width) && int(Options["ProgressInterval"]))
+      progress.report();
+
+  if (stream)
+      sync_cout << "info string " << stream->size() << " positions written to "
+                << string(Options["EPDPath"]) << sync_endl;
+}
+
+
+/// Book::filter() is called when the engine receives the "filter" command. It
+/// removes the positions from the book that are too unbalanced or where some
+/// of the MultiPV moves are not within the configured range. With StreamEPD
+/// the remaining positions are also written to the EPD file once accepted.
+/// The workers share the TT, so close decisions can differ between runs with
+/// different numbers of threads.
+
+void Book::filter(istringstream& is, PositionStore& book) {
+
+  Search::LimitsType limits = read_limits(is);
+
+  std::unique_ptr<EpdWriter> stream;
+  if (Options["StreamEPD"])
+      stream.reset(new EpdWriter(Options["EPDPath"]));
+
+  filter_job(limits, book, "", stream.get(), is.str());
+}
+
+
+/// Book::load_epd() is called when the engine receives the "load epd" command. It
+/// adds the positions of an EPD or FEN file to the book, with their analyses if
+/// the file is annotated. The file is mapped into memory and split at line
+/// boundaries, so that every worker parses and validates its own part.
+
+void Book::load_epd(istringstream& is, PositionStore& book) {
+
+  string path;
+  getline(is >> std::ws, path);
+
+  MappedFile file(path);
+  if (!file.is_open())
+  {
+      sync_cout << "info string Could not open " << path << sync_endl;
+      return;
+  }
+
+  const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+  size_t fields = std::count(variant->startFen.begin(), variant->startFen.end(), ' ') + 1;
+  bool trim = Options["TrimFEN"];
+  bool chess960 = Options["UCI_Chess960"];
+  const char* data = file.data();
+  size_t size = file.size();
+  std::mutex bookMutex;
+  std::atomic<size_t> added(0), invalid(0);
+
+  // Start of the part of the given worker, i.e., the start of the first line
+  // that begins within its share of the file.
+  auto part_start = [&](size_t idx) {
+      size_t pos = size / Threads.size() * idx;
+      if (idx == Threads.size())
+          return size;
+      while (pos > 0 && pos < size && data[pos - 1] != '\n')
+          ++pos;
+      return pos;
+  };
+
+  Threads.run_workers([&](Thread& th) {
+
+      struct Line { Key key; string fen; bool annotated; Book::Analysis analysis; };
+      vector<Line> batch;
+      StateInfo st;
+      Position pos;
+
+      auto flush = [&]() {
+          std::lock_guard<std::mutex> lk(bookMutex);
+          for (const auto& l : batch)
+              added += book.insert(variant, l.key, l.fen, l.annotated ? &l.analysis : nullptr);
+          batch.clear();
+      };
+
+      size_t end = part_start(th.id() + 1);
+      for (size_t begin = part_start(th.id()); begin < end; )
+      {
+          const char* eol = static_cast<const char*>(memchr(data + begin, '\n', end - begin));
+          size_t len = (eol ? size_t(eol - data) : end) - begin;
+          string line(data + begin, len);
+          begin += len + 1;
+
+          if (!line.empty() && line.back() == '\r')
+              line.pop_back();
+          if (line.find_first_not_of(" \t") == string::npos || line[0] == '#')
+              continue;
+
+          string ops;
+          string fen = epd_fen(line, fields, ops);
+          if (fen.empty() || fen::validate_fen(fen, variant) != fen::FEN_OK)
+          {
+              ++invalid;
+              continue;
+          }
+
+          pos.set(variant, fen, chess960, &st, &th);
+          Book::Analysis a;
+          bool annotated = epd_analysis(ops, pos, a);
+          batch.push_back({book_key(pos), book_fen(pos, trim), annotated, std::move(a)});
+          if (batch.size() >= 1024)
+              flush();
+      }
+      flush();
+  });
+
+  sync_cout << "info string Loaded " << added << " positions from " << path
+            << ", " << invalid << " invalid lines" << sync_endl;
+}
+
+
+/// Book::resume() is called when the engine receives the "resume" command. It
+/// restores the options and the book from a checkpoint file and continues the
+/// interrupted "generate" or "filter" command where it stopped.
+
+void Book::resume(istringstream& is, PositionStore& book) {
+
+  string path, line, token, command, decisions;
+  is >> std::ws;
+  getline(is, path);
+
+  ifstream file(path);
+  if (!file.is_open())
+  {
+      sync_cout << "info string Could not open checkpoint " << path << sync_endl;
+      return;
+  }
+
+  vector<GenTask> tasks;
+  vector<std::tuple<Depth, Key, Value>> memoEntries;
+  std::streamoff streamEnd = -1, keysEnd = -1;
+  Book::Analysis analysis;
+
+  book.clear();
+
+  while (getline(file, line))
+  {
+      istringstream ls(line);
+      ls >> token;
+
+      if (token == "setoption")
+      {
+          string name, value;
+          ls >> token; // Consume "name" token
+          while (ls >> token && token != "value")
+              name += (name.empty() ? "" : " ") + token;
+          getline(ls >> std::ws, value);
+          if (Options.count(name) && option_value(Options[name]) != value)
+              Options[name] = value;
+      }
+      else if (token == "command")
+          getline(ls >> std::ws, command);
+      else if (token == "task")
+      {
+          GenTask task;
+          int depth, range, imbalance, hint;
+          ls >> depth >> range >> imbalance >> hint;
+          getline(ls >> std::ws, task.fen);
+          task.depth = Depth(depth), task.range = Value(range), task.imbalance = Value(imbalance);
+          task.hint = Move(hint);
+          tasks.push_back(task);
+      }
+      else if (token == "memo")
+      {
+          int depth, range;
+          Key key;
+          ls >> depth >> key >> range;
+          memoEntries.emplace_back(Depth(depth), key, Value(range));
+      }
+      else if (token == "analysis")
+      {
+          int depth, color, move, value;
+          analysis = Analysis();
+          ls >> depth >> analysis.nodes >> color;
+          analysis.depth = Depth(depth), analysis.sideToMove = Color(color);
+          while (ls >> move >> value)
+              analysis.lines.emplace_back(Move(move), Value(value));
+      }
+      else if (token == "classified")
+      {
+          int range;
+          ls >> range;
+          analysis.classifyRange = Value(range);
+      }
+      else if (token == "position")
+      {
+          Key key;
+          string fen;
+          ls >> key;
+          getline(ls >> std::ws, fen);
+          book.insert(variants.find(Options["UCI_Variant"])->second, key, fen,
+                      analysis.lines.empty() ? nullptr : &analysis);
+          analysis.lines.clear();
+      }
+      else if (token == "decisions")
+          ls >> decisions;
+      else if (token == "stream")
+          ls >> streamEnd >> keysEnd;
+  }
+
+  std::unique_ptr<EpdWriter> stream;
+  if (streamEnd >= 0)
+      stream.reset(new EpdWriter(Options["EPDPath"], streamEnd, keysEnd));
+
+  istringstream cs(command);
+  cs >> token;
+
+  if (token == "generate")
+  {
+      Depth depth;
+      cs >> depth;
+      Search::LimitsType limits = read_limits(cs);
+      GenMemo memo(depth);
+      for (const auto& e : memoEntries)
+          memo.visit(std::get<1>(e), std::get<0>(e), std::get<2>(e));
+      multipv_gen(variants.find(Options["UCI_Variant"])->second, limits, tasks, memo, book, stream.get(), command);
+  }
+  else if (token == "filter")
+      filter_job(read_limits(cs), book, decisions, stream.get(), command);
+  else
+      sync_cout << "info string Invalid checkpoint " << path << sync_endl;
+}
+
+
+/// Book::refilter() is called when the engine receives the "refilter" command.
+/// It applies the filter thresholds to the analyses stored with the positions,
+/// without searching. Positions without an analysis are kept, and so are the
+/// ones whose range-bounded analysis is too short to accept them for sure.
+/// Classifications only hold for their range, so for another range their
+/// positions are searched again, to the depth of the classification.
+
+void Book::refilter(PositionStore& book) {
+
+  const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+  Value moveRange = int(Options["MoveScoreRange"]) * PawnValueEg / 100;
+  Value range = line_range(moveRange);
+  vector<char> keep(book.size(), true);
+  vector<size_t> classified;
+  size_t missing = 0;
+  Analysis a;
+
+  for (size_t i = 0; i < book.size(); ++i)
+      if (!book.analysis(i, a))
+          ++missing;
+      else if (a.classifyRange != VALUE_NONE && a.classifyRange != range)
+          classified.push_back(i);
+      else if (is_balanced(a) && !covers(a, range, variant, book.fen(i), Threads.main()))
+          ++missing;
+      else
+          keep[i] = is_balanced(a);
+
+  if (!classified.empty())
+  {
+      std::atomic<size_t> next(0);
+
+      Threads.run_workers([&](Thread& th) {
+          Search::LimitsType exact;
+          Analysis old;
+          for (size_t j = next++; j < classified.size() && !Threads.stop; j = next++)
+          {
+              size_t i = classified[j];
+              book.analysis(i, old);
+              exact.depth = old.depth;
+              keep[i] = is_balanced(analyse(th, variant, book.key(i), book.fen(i), exact, moveRange, nullptr));
+          }
+      });
+
+      sync_cout << "info string " << classified.size() << " classified positions searched again" << sync_endl;
+  }
+
+  book.retain(keep);
+
+  if (missing)
+      sync_cout << "info string " << missing << " positions without sufficient analysis" << sync_endl;
+}
+
+
+namespace {
+
+  // book_line() returns the line of the EPD output for the given position
+  string book_line(const PositionStore& book, size_t idx) {
+
+    Book::Analysis a;
+    if (!Options["EPDAnnotations"] || !book.analysis(idx, a))
+        return book.fen(idx);
+
+    return epd_line(book.fen(idx), a, variants.find(Options["UCI_Variant"])->second, Threads.main());
+  }
+
+} // namespace
+
+
+/// Book::file_key() identifies a position in binary books. It is the hash of
+/// the FEN without the move counters, which unlike the Zobrist key does not
+/// depend on the build.
+
+Key Book::file_key(const Position& pos) {
+
+  return fnv_hash(book_fen(pos, true));
+}
+
+
+/// Book::print() writes the book to stdout, ordered by position key
+
+void Book::print(const PositionStore& book) {
+
+  for (uint32_t idx : book.sorted())
+      sync_cout << book_line(book, idx) << sync_endl;
+}
+
+
+/// Book::save() writes the book to the EPD file given by the EPDPath option,
+/// ordered by position key. With EPDAnnotations the analyses of the positions
+/// are written as EPD operations.
+
+void Book::save(const PositionStore& book) {
+
+  ofstream file(Options["EPDPath"]);
+  for (uint32_t idx : book.sorted())
+      file << book_line(book, idx) << '\n';
+}
+
+
+/// Book::export_book() is called when the engine receives the "export" command.
+/// It writes the book with the analyses of the positions to the given file in
+/// the binary book format.
+
+void Book::export_book(istringstream& is, const PositionStore& book) {
+
+  string path;
+  getline(is >> std::ws, path);
+
+  const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+  BookFileWriter writer(path, variant, Options["UCI_Variant"]);
+  vector<BookMove> moves;
+
+  for (uint32_t idx : book.sorted())
+  {
+      string fen = book.fen(idx);
+      StateInfo st;
+      Position pos;
+      pos.set(variant, fen_with_counters(fen, variant), Options["UCI_Chess960"], &st, Threads.main());
+
+      // The scores of classified analyses are only bounds
+      Book::Analysis a;
+      if (!book.analysis(idx, a) || a.classifyRange != VALUE_NONE)
+      {
+          writer.add(file_key(pos), fen);
+          continue;
+      }
+
+      moves.clear();
+      for (const auto& line : a.lines)
+          moves.push_back({line.first == MOVE_NONE ? "" : UCI::move(pos, line.first), to_cp(line.second)});
+      writer.add(file_key(pos), fen, &moves, a.depth, a.nodes);
+  }
+
+  if (writer.finish())
+      sync_cout << "info string Exported " << book.size() << " positions to " << path << sync_endl;
+  else
+      sync_cout << "info string Could not write " << path << sync_endl;
+}
+
+
+/// Book::pack() is called when the engine receives the "pack" command. It
+/// compresses an EPD file of the current variant into the stream format.
+
+void Book::pack(istringstream& is) {
+
+  string in, out, line;
+  is >> in >> out;
+
+  ifstream file(in);
+  if (!file.is_open())
+  {
+      sync_cout << "info string Could not open " << in << sync_endl;
+      return;
+  }
+
+  StreamWriter writer(out, variants.find(Options["UCI_Variant"])->second, string(Options["UCI_Variant"]));
+  size_t lines = 0;
+  while (getline(file, line))
+      writer.write(line), ++lines;
+
+  if (writer.close())
+      sync_cout << "info string Packed " << lines << " lines into " << out << sync_endl;
+  else
+      sync_cout << "info string Could not write " << out << sync_endl;
+}
+
+
+/// Book::unpack() is called when the engine receives the "unpack" command. It
+/// restores the EPD file from a stream.
+
+void Book::unpack(istringstream& is) {
+
+  string in, out, line;
+  is >> in >> out;
+
+  StreamReader reader(in);
+  if (!reader.is_open())
+  {
+      sync_cout << "info string Could not open " << in << " as a stream" << sync_endl;
+      return;
+  }
+
+  ofstream file(out);
+  size_t lines = 0;
+  while (reader.next(line))
+      file << line << '\n', ++lines;
+
+  sync_cout << "info string Unpacked " << lines << " lines into " << out
+            << (reader.corrupt() ? ", the rest of the stream is corrupt" : "") << sync_endl;
+}
+
+
+/// Book::merge() is called when the engine receives the "merge" command. It
+/// combines EPD files, e.g., the outputs of shards, into the first given file.
+/// Of the lines of the same position the first one is kept, and the positions
+/// are ordered by their book file keys, so that the result is the same however
+/// the work was split. The BookMemory budget applies.
+
+void Book::merge(istringstream& is) {
+
+  string out, in, line, ops;
+  is >> out;
+
+  const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+  size_t fields = std::count(variant->startFen.begin(), variant->startFen.end(), ' ') + 1;
+  bool chess960 = Options["UCI_Chess960"];
+  string dir = Options["SpillPath"] == "<empty>" ? "" : string(Options["SpillPath"]);
+  SpillSorter sorter(variant, size_t(int(Options["BookMemory"])) << 20, dir);
+  size_t lines = 0, invalid = 0;
+  StateInfo st;
+  Position pos;
+
+  while (is >> in)
+  {
+      ifstream file(in);
+      if (!file.is_open())
+          sync_cout << "info string Could not open " << in << sync_endl;
+
+      while (getline(file, line))
+      {
+          if (!line.empty() && line.back() == '\r')
+              line.pop_back();
+          if (line.find_first_not_of(" \t") == string::npos || line[0] == '#')
+              continue;
+
+          string fen = epd_fen(line, fields, ops);
+          if (fen.empty() || fen::validate_fen(fen, variant) != fen::FEN_OK)
+          {
+              ++invalid;
+              continue;
+          }
+
+          pos.set(variant, fen, chess960, &st, Threads.main());
+          sorter.add(file_key(pos), line);
+          ++lines;
+      }
+  }
+
+  ofstream file(out);
+  size_t positions = sorter.merge([&](Key, const string& l) { file << l << '\n'; });
+
+  if (!sorter.good())
+  {
+      sync_cout << "info string Could not write or read the spilled runs, " << out << " is incomplete" << sync_endl;
+      return;
+  }
+
+  sync_cout << "info string Merged " << lines << " lines into " << positions << " positions in "
+            << out << ", " << invalid << " invalid lines" << sync_endl;
+}
+
+
+/// Book::import_book() is called when the engine receives the "import" command.
+/// It adds the positions of a binary book of the current variant to the book.
+
+void Book::import_book(istringstream& is, PositionStore& book) {
+
+  string path;
+  getline(is >> std::ws, path);
+
+  BookFile file(path);
+  if (!file.is_open() || file.variant() != string(Options["UCI_Variant"]))
+  {
+      sync_cout << "info string Could not open " << path << " as a book of "
+                << string(Options["UCI_Variant"]) << sync_endl;
+      return;
+  }
+
+  const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+  vector<BookMove> moves;
+  size_t added = 0, invalid = 0;
+  string fen;
+
+  // The Zobrist keys depend on the build, so they are computed anew
+  for (size_t idx = 0; idx < file.size(); ++idx)
+  {
+      if (   !file.fen(idx, fen)
+          || fen::validate_fen(fen_with_counters(fen, variant), variant) != fen::FEN_OK)
+      {
+          ++invalid;
+          continue;
+      }
+
+      StateInfo st;
+      Position pos;
+      pos.set(variant, fen_with_counters(fen, variant), Options["UCI_Chess960"], &st, Threads.main());
+
+      Book::Analysis a;
+      if (!file.moves(idx, moves, a.depth, a.nodes))
+      {
+          added += book.insert(variant, book_key(pos), fen);
+          continue;
+      }
+
+      a.sideToMove = pos.side_to_move();
+      for (auto& m : moves)
+          a.lines.emplace_back(m.move.empty() ? MOVE_NONE : UCI::to_move(pos, m.move), from_cp(m.score));
+      added += book.insert(variant, book_key(pos), fen, &a);
+  }
+
+  sync_cout << "info string Imported " << added << " positions from " << path
+            << ", " << invalid << " invalid records" << sync_endl;
+}
@@ -0,0 +1,49 @@
+/*
+  Fairy-Stockfish, a UCI chess variant playing engine derived from Stockfish
+  Copyright (C) 2018-2021 Fabian Fichter
+
+  Fairy-Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Fairy-Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BOOK_H_INCLUDED
+#define BOOK_H_INCLUDED
+
+#include <sstream>
+
+#include "bookstore.h"
+
+class Position;
+
+/// The Book namespace contains the commands for generating and filtering
+/// opening books. The working set of positions is kept by the caller.
+
+namespace Book {
+
+void generate(Position& pos, std::istringstream& is, PositionStore& book);
+void filter(std::istringstream& is, PositionStore& book);
+void resume(std::istringstream& is, PositionStore& book);
+void load_epd(std::istringstream& is, PositionStore& book);
+void refilter(PositionStore& book);
+void print(const PositionStore& book);
+void save(const PositionStore& book);
+void export_book(std::istringstream& is, const PositionStore& book);
+void import_book(std::istringstream& is, PositionStore& book);
+void pack(std::istringstream& is);
+void unpack(std::istringstream& is);
+void merge(std::istringstream& is);
+Key file_key(const Position& pos);
+
+} // namespace Book
+
+#endif // #ifndef BOOK_H_INCLUDED
@@ -0,0 +1,1199 @@
+/*
+  Fairy-Stockfish, a UCI chess variant playing engine derived from Stockfish
+  Copyright (C) 2018-2021 Fabian Fichter
+
+  Fairy-Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Fairy-Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <queue>
+
+#include "bookstore.h"
+#include "variant.h"
+
+namespace {
+
+  void write_varint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80)
+    {
+        out.push_back(uint8_t(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+  }
+
+  uint64_t read_varint(const uint8_t*& data) {
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        uint8_t b = *data++;
+        v |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+  }
+
+  // read_varint() with an end returns false if the varint does not end before
+  // it. Without an end, i.e., nullptr, the data is trusted.
+  bool read_varint(const uint8_t*& data, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (data == end)
+            return false;
+        uint8_t b = *data++;
+        v |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+  }
+
+  struct BitWriter {
+    std::vector<uint8_t>& out;
+    int used = 8; // Bits used in the last byte
+
+    void put(unsigned v, int bits) {
+      while (bits--)
+      {
+          if (used == 8)
+              out.push_back(0), used = 0;
+          out.back() |= ((v >> bits) & 1) << (7 - used++);
+      }
+    }
+  };
+
+  template<typename T>
+  void write_raw(std::vector<uint8_t>& out, T v) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(T));
+  }
+
+  template<typename T>
+  bool read_raw(std::istream& in, T& v) {
+    return bool(in.read(reinterpret_cast<char*>(&v), sizeof(T)));
+  }
+
+  // The fixed-size numbers of the book files are little-endian
+  void write_le(std::vector<uint8_t>& out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+        out.push_back(uint8_t(v >> (8 * i)));
+  }
+
+  uint64_t read_le(const uint8_t* data, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i)
+        v |= uint64_t(data[i]) << (8 * i);
+    return v;
+  }
+
+  constexpr char BookMagic[8] = { 'B', 'G', 'B', 'O', 'O', 'K', '0', '2' };
+  constexpr size_t BookHeaderSize = 28;
+  constexpr char StreamMagic[8] = { 'B', 'G', 'S', 'T', 'R', 'M', '0', '1' };
+  constexpr char CacheMagic[8] = { 'B', 'G', 'C', 'A', 'C', 'H', 'E', 0 };
+  constexpr uint32_t CacheVersion = 2; // 1: no nodes and side to move
+  constexpr size_t MaxMergeRuns = 32;
+
+  enum RecordType : uint8_t { FULL_RECORD, DELTA_RECORD, DELTA_TEXT_RECORD };
+
+  struct BitReader {
+    const uint8_t* data;
+    const uint8_t* end; // Unbounded if nullptr
+    int used = 0;
+    bool overrun = false;
+
+    unsigned get(int bits) {
+      unsigned v = 0;
+      while (bits--)
+      {
+          if (data == end)
+          {
+              overrun = true;
+              return 0;
+          }
+          v = (v << 1) | ((*data >> (7 - used)) & 1);
+          if (++used == 8)
+              ++data, used = 0;
+      }
+      return v;
+    }
+  };
+
+} // namespace
+
+namespace Book {
+
+FenCodec::FenCodec(const Variant* v) : files(v->maxFile + 1), ranks(v->maxRank + 1) {
+
+  for (char c : v->pieceToChar)
+      if (c != ' ' && pieceChars.find(c) == std::string::npos)
+          pieceChars += c;
+
+  while ((1U << codeBits) <= pieceChars.size())
+      ++codeBits;
+}
+
+
+/// FenCodec::encode() appends the packed FEN to the given buffer. The header
+/// holds the length of the verbatim part and a flag whether a packed board
+/// follows it.
+
+void FenCodec::encode(const std::string& fen, std::vector<uint8_t>& out) const {
+
+  size_t boardEnd = fen.find_first_of(" [");
+  size_t start = out.size();
+
+  if (files && boardEnd != std::string::npos)
+  {
+      std::vector<uint8_t> board;
+      BitWriter bw{board};
+      int file = 0, rank = 0;
+      bool ok = true, promoted = false;
+
+      for (size_t i = 0; i < boardEnd && ok; ++i)
+      {
+          char c = fen[i];
+          if (isdigit(c))
+          {
+              int n = c - '0';
+              while (i + 1 < boardEnd && isdigit(fen[i + 1]))
+                  n = std::min(10 * n + fen[++i] - '0', files + 1); // Invalid anyway
+              for (file += n; n > 0; --n)
+                  bw.put(0, 1);
+          }
+          else if (c == '/')
+          {
+              ok = file == files && ++rank < ranks;
+              file = 0;
+          }
+          else if (c == '+')
+              promoted = true;
+          else
+          {
+              size_t code = pieceChars.find(c) + 1;
+              bool tilde = i + 1 < boardEnd && fen[i + 1] == '~';
+              ok = code && !(promoted && tilde);
+              bw.put(1, 1);
+              if (promoted || tilde)
+              {
+                  bw.put(0, codeBits);
+                  bw.put(tilde, 1);
+                  i += tilde;
+              }
+              bw.put(unsigned(code), codeBits);
+              promoted = false;
+              ++file;
+          }
+      }
+
+      if (ok && file == files && rank == ranks - 1)
+      {
+          write_varint(out, (fen.size() - boardEnd) << 1 | 1);
+          out.insert(out.end(), fen.begin() + boardEnd, fen.end());
+          out.insert(out.end(), board.begin(), board.end());
+
+          // Non-canonical FENs, e.g., with split empty squares, are kept verbatim
+          if (decode(&out[start]) == fen)
+              return;
+
+          out.resize(start);
+      }
+  }
+
+  write_varint(out, fen.size() << 1);
+  out.insert(out.end(), fen.begin(), fen.end());
+}
+
+
+/// FenCodec::decode() restores the FEN from the packed data. The data of the
+/// files is bounded by an end, and decoding fails if the record exceeds it or
+/// holds invalid piece codes.
+
+std::string FenCodec::decode(const uint8_t* data) const {
+
+  std::string fen;
+  decode(data, nullptr, fen);
+  return fen;
+}
+
+bool FenCodec::decode(const uint8_t* data, const uint8_t* end, std::string& fen) const {
+
+  uint64_t header;
+  if (!read_varint(data, end, header) || (end && (header >> 1) > uint64_t(end - data)))
+      return false;
+
+  std::string text(data, data + (header >> 1));
+  fen.clear();
+
+  if (!(header & 1))
+  {
+      fen = text;
+      return true;
+  }
+
+  BitReader br{data + text.size(), end};
+
+  for (int r = 0; r < ranks; ++r)
+  {
+      int emptyCnt = 0;
+      for (int f = 0; f < files; ++f)
+      {
+          if (!br.get(1))
+          {
+              ++emptyCnt;
+              continue;
+          }
+          if (emptyCnt)
+              fen += std::to_string(emptyCnt), emptyCnt = 0;
+
+          unsigned code = br.get(codeBits);
+          bool tilde = false;
+          if (!code)
+          {
+              tilde = br.get(1);
+              code = br.get(codeBits);
+              if (!tilde)
+                  fen += '+';
+          }
+          if (!code || code > pieceChars.size())
+              return false;
+          fen += pieceChars[code - 1];
+          if (tilde)
+              fen += '~';
+      }
+      if (emptyCnt)
+          fen += std::to_string(emptyCnt);
+      if (r < ranks - 1)
+          fen += '/';
+  }
+
+  fen += text;
+  return !br.overrun;
+}
+
+
+/// FenCodec::split() parses the board of the FEN into a code per square, in
+/// the order of the FEN, and the rest of the FEN. The code of a piece holds
+/// its index in the piece table and flags for promoted and tilde pieces, and
+/// it is zero for an empty square. It returns false for FENs that can not be
+/// reproduced exactly by join().
+
+bool FenCodec::split(const std::string& fen, std::vector<uint16_t>& board, std::string& text) const {
+
+  size_t boardEnd = fen.find_first_of(" [");
+  if (!files || boardEnd == std::string::npos)
+      return false;
+
+  board.assign(size_t(files * ranks), 0);
+  int file = 0, rank = 0;
+  bool promoted = false;
+
+  for (size_t i = 0; i < boardEnd; ++i)
+  {
+      char c = fen[i];
+      if (isdigit(c))
+      {
+          int n = c - '0';
+          while (i + 1 < boardEnd && isdigit(fen[i + 1]))
+              n = std::min(10 * n + fen[++i] - '0', files + 1); // Invalid anyway
+          file += n;
+      }
+      else if (c == '/')
+      {
+          if (file != files || ++rank >= ranks)
+              return false;
+          file = 0;
+      }
+      else if (c == '+')
+          promoted = true;
+      else
+      {
+          size_t code = pieceChars.find(c) + 1;
+          bool tilde = i + 1 < boardEnd && fen[i + 1] == '~';
+          if (!code || file >= files || (promoted && tilde))
+              return false;
+          board[size_t(rank * files + file++)] = uint16_t(code << 2 | tilde << 1 | promoted);
+          i += tilde;
+          promoted = false;
+      }
+  }
+
+  text = fen.substr(boardEnd);
+  return file == files && rank == ranks - 1 && join(board, text) == fen;
+}
+
+std::string FenCodec::join(const std::vector<uint16_t>& board, const std::string& text) const {
+
+  std::string fen;
+  for (int r = 0; r < ranks; ++r)
+  {
+      int emptyCnt = 0;
+      for (int f = 0; f < files; ++f)
+      {
+          uint16_t code = board[size_t(r * files + f)];
+          if (!code)
+          {
+              ++emptyCnt;
+              continue;
+          }
+          if (emptyCnt)
+              fen += std::to_string(emptyCnt), emptyCnt = 0;
+          if (code & 1)
+              fen += '+';
+          fen += pieceChars[(code >> 2) - 1];
+          if (code & 2)
+              fen += '~';
+      }
+      if (emptyCnt)
+          fen += std::to_string(emptyCnt);
+      if (r < ranks - 1)
+          fen += '/';
+  }
+
+  return fen + text;
+}
+
+
+/// PositionStore::insert() adds a position unless a position with the same key
+/// is already stored. It returns whether the position was added. Positions of
+/// another variant than the first one are stored verbatim. The payload starts
+/// with the length of the packed analysis, which is zero if there is none.
+
+bool PositionStore::insert(const Variant* v, Key key, const std::string& fen, const Analysis* a) {
+
+  if ((entries.size() + 1) * 4 > slots.size() * 3)
+      rehash(std::max(size_t(1024), 2 * slots.size()));
+
+  size_t s = find_slot(key);
+  if (slots[s])
+      return false;
+
+  if (!variant)
+  {
+      variant = v;
+      codec = FenCodec(v);
+  }
+
+  assert(entries.size() < UINT32_MAX);
+
+  entries.push_back({key, arena.size()});
+
+  if (a)
+  {
+      std::vector<uint8_t> note;
+      write_varint(note, uint64_t(a->depth));
+      write_varint(note, a->nodes);
+      write_varint(note, uint64_t(a->sideToMove));
+      write_varint(note, a->classifyRange == VALUE_NONE ? 0 : uint64_t(a->classifyRange) + 1);
+      write_varint(note, a->lines.size());
+      for (const auto& line : a->lines)
+      {
+          write_varint(note, uint32_t(line.first));
+          write_varint(note, uint32_t(line.second) << 1 ^ uint32_t(line.second >> 31)); // Zigzag
+      }
+      write_varint(arena, note.size());
+      arena.insert(arena.end(), note.begin(), note.end());
+  }
+  else
+      write_varint(arena, 0);
+
+  if (v == variant)
+      codec.encode(fen, arena);
+  else
+      FenCodec().encode(fen, arena);
+  slots[s] = uint32_t(entries.size());
+
+  return true;
+}
+
+bool PositionStore::contains(Key key) const {
+
+  return !slots.empty() && slots[find_slot(key)];
+}
+
+std::string PositionStore::fen(size_t idx) const {
+
+  const uint8_t* data = &arena[entries[idx].offset];
+  uint64_t noteLen = read_varint(data);
+  return codec.decode(data + noteLen);
+}
+
+bool PositionStore::analysis(size_t idx, Analysis& a) const {
+
+  const uint8_t* data = &arena[entries[idx].offset];
+  if (!read_varint(data))
+      return false;
+
+  a.depth = Depth(read_varint(data));
+  a.nodes = read_varint(data);
+  a.sideToMove = Color(read_varint(data));
+  uint64_t classifyRange = read_varint(data);
+  a.classifyRange = classifyRange ? Value(classifyRange - 1) : VALUE_NONE;
+  a.lines.resize(read_varint(data));
+  for (auto& line : a.lines)
+  {
+      Move m = Move(read_varint(data));
+      uint32_t v = uint32_t(read_varint(data));
+      line = {m, Value(int32_t(v >> 1) ^ -int32_t(v & 1))};
+  }
+  return true;
+}
+
+
+/// PositionStore::retain() removes all positions for which the given flag is
+/// not set. The remaining payloads are moved down within the arena, so that no
+/// additional memory is needed.
+
+void PositionStore::retain(const std::vector<char>& keep) {
+
+  assert(keep.size() == entries.size());
+
+  size_t n = 0;
+  uint64_t end = 0;
+
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+      uint64_t begin = entries[i].offset;
+      uint64_t len = (i + 1 < entries.size() ? entries[i + 1].offset : arena.size()) - begin;
+
+      if (!keep[i])
+          continue;
+
+      if (begin != end)
+          std::memmove(&arena[end], &arena[begin], len);
+      entries[n++] = {entries[i].key, end};
+      end += len;
+  }
+
+  entries.resize(n);
+  arena.resize(end);
+
+  size_t slotCount = 1024;
+  while (slotCount * 3 < n * 4)
+      slotCount *= 2;
+  rehash(slotCount);
+}
+
+void PositionStore::clear() {
+
+  variant = nullptr;
+  std::vector<Entry>().swap(entries);
+  std::vector<uint32_t>().swap(slots);
+  std::vector<uint8_t>().swap(arena);
+}
+
+
+/// PositionStore::sorted() returns the indices of the positions in the order
+/// of their keys, which gives a reproducible order for exporting the book.
+
+std::vector<uint32_t> PositionStore::sorted() const {
+
+  std::vector<uint32_t> order(entries.size());
+  for (size_t i = 0; i < order.size(); ++i)
+      order[i] = uint32_t(i);
+
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return entries[a].key < entries[b].key;
+  });
+
+  return order;
+}
+
+size_t PositionStore::find_slot(Key key) const {
+
+  size_t mask = slots.size() - 1;
+  size_t s = size_t(key) & mask;
+
+  while (slots[s] && entries[slots[s] - 1].key != key)
+      s = (s + 1) & mask;
+
+  return s;
+}
+
+void PositionStore::rehash(size_t slotCount) {
+
+  slots.assign(slotCount, 0);
+
+  for (size_t i = 0; i < entries.size(); ++i)
+      slots[find_slot(entries[i].key)] = uint32_t(i + 1);
+}
+
+
+/// SpillSorter::SpillSorter() prepares the names of the run files, which are
+/// placed into the given directory or else into the temporary directory.
+
+SpillSorter::SpillSorter(const Variant* v, size_t budgetBytes, const std::string& dir)
+  : codec(v), budget(budgetBytes) {
+
+  static std::atomic<uint64_t> instances(0);
+  std::filesystem::path base = dir.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(dir);
+  prefix = (base / ("bookgen-" + std::to_string(uintptr_t(this)) + "-" + std::to_string(instances++) + "-")).string();
+}
+
+SpillSorter::~SpillSorter() {
+
+  clear();
+}
+
+void SpillSorter::clear() {
+
+  for (const std::string& run : runs)
+      std::remove(run.c_str());
+  runs.clear();
+  std::vector<Entry>().swap(entries);
+  std::vector<uint8_t>().swap(arena);
+}
+
+void SpillSorter::add(Key key, const std::string& fen) {
+
+  if (failed)
+      return;
+
+  packed.clear();
+  codec.encode(fen, packed);
+  entries.push_back({key, arena.size()});
+  write_varint(arena, packed.size());
+  arena.insert(arena.end(), packed.begin(), packed.end());
+
+  if (budget && entries.size() * sizeof(Entry) + arena.size() > budget)
+      spill();
+}
+
+void SpillSorter::sort_entries() {
+
+  // Among duplicates, the position added first is kept
+  std::stable_sort(entries.begin(), entries.end(), [](const Entry& e1, const Entry& e2) {
+      return e1.key < e2.key;
+  });
+}
+
+std::string SpillSorter::new_run() {
+
+  return prefix + std::to_string(runNames++);
+}
+
+
+/// SpillSorter::write_run() writes the records that the callback passes to the
+/// sink as a run file of key, length and packed FEN. It returns false if the
+/// file cannot be written completely.
+
+bool SpillSorter::write_run(const std::string& path, const std::function<bool(const RecordSink&)>& fill) {
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out.is_open())
+      return false;
+
+  std::vector<uint8_t> record;
+  bool ok = fill([&](Key key, const uint8_t* data, uint32_t len) {
+      record.clear();
+      write_raw(record, uint64_t(key));
+      write_raw(record, len);
+      record.insert(record.end(), data, data + len);
+      return bool(out.write(reinterpret_cast<const char*>(record.data()), std::streamsize(record.size())));
+  });
+
+  out.close();
+  return ok && !out.fail();
+}
+
+
+/// SpillSorter::spill() writes the positions in memory to a new run file,
+/// sorted by key and without duplicates.
+
+void SpillSorter::spill() {
+
+  sort_entries();
+
+  runs.push_back(new_run());
+  failed = !write_run(runs.back(), [&](const RecordSink& sink) {
+      for (size_t i = 0; i < entries.size(); ++i)
+      {
+          if (i && entries[i].key == entries[i - 1].key)
+              continue;
+          const uint8_t* data = &arena[entries[i].offset];
+          uint32_t len = uint32_t(read_varint(data));
+          if (!sink(entries[i].key, data, len))
+              return false;
+      }
+      return true;
+  });
+
+  std::vector<Entry>().swap(entries);
+  std::vector<uint8_t>().swap(arena);
+}
+
+
+/// SpillSorter::merge_runs() merges the runs from first to last, and the
+/// positions in memory if asked for, which are treated as one more run after
+/// them. Each key is passed to the sink once, with the packed FEN of its
+/// first position. It returns false if a run cannot be read or the sink fails.
+
+bool SpillSorter::merge_runs(size_t first, size_t last, bool memory, const RecordSink& sink) {
+
+  struct Source {
+    bool run;         // A run file, or else the positions in memory
+    std::ifstream in;
+    size_t next = 0;  // Entry in memory
+    Key key = 0;
+    const uint8_t* packed = nullptr;
+    uint32_t len = 0;
+    std::vector<uint8_t> data;
+  };
+
+  std::vector<Source> sources(last - first + memory);
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+      sources[i].run = first + i < last;
+      if (sources[i].run)
+      {
+          sources[i].in.open(runs[first + i], std::ios::binary);
+          if (!sources[i].in.is_open())
+              return false;
+      }
+  }
+
+  bool ok = true;
+
+  auto advance = [&](Source& s) {
+      if (s.run)
+      {
+          uint64_t key;
+          // A run may only end between two records
+          if (!read_raw(s.in, key))
+          {
+              ok = ok && s.in.eof() && !s.in.gcount();
+              return false;
+          }
+          if (!read_raw(s.in, s.len))
+              return ok = false;
+          s.key = Key(key);
+          s.data.resize(s.len);
+          s.packed = s.data.data();
+          if (!s.in.read(reinterpret_cast<char*>(s.data.data()), s.len))
+              return ok = false;
+          return true;
+      }
+      if (s.next >= entries.size())
+          return false;
+      s.key = entries[s.next].key;
+      s.packed = &arena[entries[s.next++].offset];
+      s.len = uint32_t(read_varint(s.packed));
+      return true;
+  };
+
+  typedef std::pair<Key, size_t> HeapItem;
+  std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+  for (size_t i = 0; i < sources.size(); ++i)
+      if (advance(sources[i]))
+          heap.emplace(sources[i].key, i);
+
+  bool emitted = false;
+  Key lastKey = 0;
+
+  while (ok && !heap.empty())
+  {
+      Source& s = sources[heap.top().second];
+      heap.pop();
+      if (!emitted || s.key != lastKey)
+      {
+          if (!sink(s.key, s.packed, s.len))
+              return false;
+          lastKey = s.key;
+          emitted = true;
+      }
+      if (advance(s))
+          heap.emplace(s.key, size_t(&s - &sources[0]));
+  }
+
+  return ok;
+}
+
+
+/// SpillSorter::merge() passes all positions to the callback in the order of
+/// their keys, each key only once, and returns their number. The runs are
+/// merged with the positions in memory. At most MaxMergeRuns runs are opened
+/// at once, so more runs are first merged in passes into fewer, longer ones.
+/// The sorter is empty afterwards.
+
+size_t SpillSorter::merge(const std::function<void(Key, const std::string&)>& emit) {
+
+  sort_entries();
+
+  while (!failed && runs.size() > MaxMergeRuns)
+  {
+      std::vector<std::string> merged;
+      for (size_t first = 0; first < runs.size() && !failed; first += MaxMergeRuns)
+      {
+          merged.push_back(new_run());
+          failed = !write_run(merged.back(), [&](const RecordSink& sink) {
+              return merge_runs(first, std::min(first + MaxMergeRuns, runs.size()), false, sink);
+          });
+      }
+      for (const std::string& run : runs)
+          std::remove(run.c_str());
+      runs.swap(merged);
+  }
+
+  size_t count = 0;
+  if (!failed)
+      failed = !merge_runs(0, runs.size(), true, [&](Key key, const uint8_t* data, uint32_t) {
+          emit(key, codec.decode(data));
+          ++count;
+          return true;
+      });
+
+  clear();
+
+  return count;
+}
+
+
+/// BookFile::BookFile() maps the book file and checks its header. The book is
+/// not open if the file is no book or its variant is unknown. The records are
+/// only checked when they are read, against the start of the index.
+
+BookFile::BookFile(const std::string& path) : file(path) {
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(file.data());
+  if (!data || file.size() < BookHeaderSize || std::memcmp(data, BookMagic, sizeof(BookMagic)))
+      return;
+
+  uint64_t positions = read_le(data + 8, 8);
+  uint64_t indexOffset = read_le(data + 16, 8);
+  uint64_t nameLen = read_le(data + 24, 4);
+  if (   nameLen > file.size() - BookHeaderSize || indexOffset < BookHeaderSize + nameLen
+      || indexOffset > file.size() || (file.size() - indexOffset) / 16 < positions)
+      return;
+
+  variantName.assign(reinterpret_cast<const char*>(data) + BookHeaderSize, size_t(nameLen));
+  auto it = variants.find(variantName);
+  if (it == variants.end())
+      return;
+
+  codec = FenCodec(it->second);
+  records = data + BookHeaderSize + nameLen;
+  index = data + indexOffset;
+  count = size_t(positions);
+  valid = true;
+}
+
+/// BookFile::record() returns the record of the given entry of the index, or
+/// nullptr if its offset is not within the records.
+
+const uint8_t* BookFile::record(size_t idx) const {
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(file.data());
+  uint64_t offset = read_le(index + 16 * idx + 8, 8);
+  return offset >= uint64_t(records - data) && offset < uint64_t(index - data) ? data + offset : nullptr;
+}
+
+Key BookFile::key(size_t idx) const {
+
+  return Key(read_le(index + 16 * idx, 8));
+}
+
+bool BookFile::find(Key k, size_t& idx) const {
+
+  size_t lo = 0, hi = count;
+  while (lo < hi)
+  {
+      size_t mid = lo + (hi - lo) / 2;
+      if (key(mid) < k)
+          lo = mid + 1;
+      else
+          hi = mid;
+  }
+  idx = lo;
+  return lo < count && key(lo) == k;
+}
+
+/// BookFile::fen() decodes the FEN of a position. It returns false if the
+/// record is corrupt.
+
+bool BookFile::fen(size_t idx, std::string& fen) const {
+
+  const uint8_t* data = record(idx);
+  uint64_t noteLen;
+  return   data && read_varint(data, index, noteLen) && noteLen < uint64_t(index - data)
+        && codec.decode(data + noteLen, index, fen);
+}
+
+/// BookFile::moves() reads the analysis of a position. It returns false if
+/// there is none or if the record is corrupt.
+
+bool BookFile::moves(size_t idx, std::vector<BookMove>& moves, Depth& depth, uint64_t& nodes) const {
+
+  const uint8_t* data = record(idx);
+  uint64_t noteLen, d, n, size;
+  moves.clear();
+  if (!data || !read_varint(data, index, noteLen) || !noteLen || noteLen > uint64_t(index - data))
+      return false;
+
+  const uint8_t* end = data + noteLen;
+  if (   !read_varint(data, end, d) || !read_varint(data, end, n) || !read_varint(data, end, size)
+      || size > uint64_t(end - data))
+      return false;
+
+  moves.resize(size_t(size));
+  for (auto& m : moves)
+  {
+      uint64_t len, v;
+      if (!read_varint(data, end, len) || len > uint64_t(end - data))
+          return moves.clear(), false;
+      m.move.assign(reinterpret_cast<const char*>(data), size_t(len));
+      data += len;
+      if (!read_varint(data, end, v))
+          return moves.clear(), false;
+      m.score = int32_t(uint32_t(v) >> 1) ^ -int32_t(v & 1);
+  }
+  depth = Depth(d);
+  nodes = n;
+  return true;
+}
+
+
+/// BookFileWriter::BookFileWriter() writes the header, where the number of
+/// positions and the offset of the index are filled in by finish(). The book
+/// is written to a temporary file first, so that readers which still map the
+/// previous book keep seeing it in full.
+
+BookFileWriter::BookFileWriter(const std::string& bookPath, const Variant* v, const std::string& name)
+  : path(bookPath), file(bookPath + ".tmp", std::ios::binary), codec(v) {
+
+  std::vector<uint8_t> header(BookMagic, BookMagic + sizeof(BookMagic));
+  write_le(header, 0, 8);
+  write_le(header, 0, 8);
+  write_le(header, name.size(), 4);
+  header.insert(header.end(), name.begin(), name.end());
+  file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+  offset = header.size();
+}
+
+void BookFileWriter::add(Key key, const std::string& fen, const std::vector<BookMove>* moves,
+                         Depth depth, uint64_t nodes) {
+
+  std::vector<uint8_t> note, record;
+  if (moves)
+  {
+      write_varint(note, uint64_t(depth));
+      write_varint(note, nodes);
+      write_varint(note, moves->size());
+      for (const auto& m : *moves)
+      {
+          write_varint(note, m.move.size());
+          note.insert(note.end(), m.move.begin(), m.move.end());
+          write_varint(note, uint32_t(m.score) << 1 ^ uint32_t(m.score >> 31)); // Zigzag
+      }
+  }
+  write_varint(record, note.size());
+  record.insert(record.end(), note.begin(), note.end());
+  codec.encode(fen, record);
+
+  index.emplace_back(key, offset);
+  file.write(reinterpret_cast<const char*>(record.data()), std::streamsize(record.size()));
+  offset += record.size();
+}
+
+/// BookFileWriter::finish() appends the sorted index and completes the header,
+/// then replaces the book by the temporary file. It returns whether the book
+/// has been written successfully.
+
+bool BookFileWriter::finish() {
+
+  std::sort(index.begin(), index.end());
+
+  std::vector<uint8_t> out(size_t((8 - offset % 8) % 8), 0);
+  uint64_t indexOffset = offset + out.size();
+  for (const auto& e : index)
+  {
+      write_le(out, e.first, 8);
+      write_le(out, e.second, 8);
+  }
+  file.write(reinterpret_cast<const char*>(out.data()), std::streamsize(out.size()));
+
+  out.clear();
+  write_le(out, index.size(), 8);
+  write_le(out, indexOffset, 8);
+  file.seekp(8);
+  file.write(reinterpret_cast<const char*>(out.data()), std::streamsize(out.size()));
+  file.close();
+
+  std::string tmpPath = path + ".tmp";
+  if (file.fail())
+  {
+      std::remove(tmpPath.c_str());
+      return false;
+  }
+
+  std::remove(path.c_str());
+  return !std::rename(tmpPath.c_str(), path.c_str());
+}
+
+
+/// StreamWriter::StreamWriter() starts a stream with the magic and the name of
+/// the variant.
+
+StreamWriter::StreamWriter(const std::string& path, const Variant* v, const std::string& name)
+  : file(path, std::ios::binary), codec(v) {
+
+  std::vector<uint8_t> header(StreamMagic, StreamMagic + sizeof(StreamMagic));
+  write_varint(header, name.size());
+  header.insert(header.end(), name.begin(), name.end());
+  file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+}
+
+
+/// StreamWriter::write() appends the line as a delta record if the board of
+/// the previous line is known and the delta is smaller than the full record.
+/// A delta record lists the changed squares as the gaps between them and their
+/// new codes.
+
+void StreamWriter::write(const std::string& line) {
+
+  full.clear();
+  full.push_back(FULL_RECORD);
+  std::vector<uint8_t> packed;
+  codec.encode(line, packed);
+  write_varint(full, packed.size());
+  full.insert(full.end(), packed.begin(), packed.end());
+
+  bool parsed = codec.split(line, board, text);
+  const std::vector<uint8_t>* out = &full;
+
+  if (parsed && hasPrevious && board.size() == previous.size())
+  {
+      size_t changes = 0;
+      for (size_t s = 0; s < board.size(); ++s)
+          changes += board[s] != previous[s];
+
+      record.clear();
+      record.push_back(text == previousText ? DELTA_RECORD : DELTA_TEXT_RECORD);
+      write_varint(record, changes);
+      size_t last = 0;
+      for (size_t s = 0; s < board.size(); ++s)
+          if (board[s] != previous[s])
+          {
+              write_varint(record, s - last);
+              write_varint(record, board[s]);
+              last = s + 1;
+          }
+      if (text != previousText)
+      {
+          write_varint(record, text.size());
+          record.insert(record.end(), text.begin(), text.end());
+      }
+      if (record.size() < full.size())
+          out = &record;
+  }
+
+  file.write(reinterpret_cast<const char*>(out->data()), std::streamsize(out->size()));
+
+  hasPrevious = parsed;
+  if (parsed)
+  {
+      previous.swap(board);
+      previousText.swap(text);
+  }
+}
+
+bool StreamWriter::close() {
+
+  file.close();
+  return !file.fail();
+}
+
+
+/// StreamReader::StreamReader() maps the stream and checks its header. The
+/// stream is not open if the file is no stream or its variant is unknown.
+
+StreamReader::StreamReader(const std::string& path) : file(path) {
+
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(file.data());
+  if (!p || file.size() < sizeof(StreamMagic) + 1 || std::memcmp(p, StreamMagic, sizeof(StreamMagic)))
+      return;
+
+  end = p + file.size();
+  p += sizeof(StreamMagic);
+  uint64_t nameLen;
+  if (!read_varint(p, end, nameLen) || nameLen > uint64_t(end - p))
+      return;
+  variantName.assign(reinterpret_cast<const char*>(p), size_t(nameLen));
+  auto it = variants.find(variantName);
+  if (it == variants.end())
+      return;
+
+  codec = FenCodec(it->second);
+  data = p + nameLen;
+}
+
+
+/// StreamReader::next() decodes the next line. It returns false at the end of
+/// the stream, or if the rest of the stream is corrupt, i.e., a record exceeds
+/// the file or does not fit the board of the previous line.
+
+bool StreamReader::next(std::string& line) {
+
+  if (!data || data >= end || failed)
+      return false;
+
+  failed = !read_record(line);
+  return !failed;
+}
+
+bool StreamReader::read_record(std::string& line) {
+
+  uint8_t type = *data++;
+  uint64_t len, changes, gap, code;
+
+  if (type == FULL_RECORD)
+  {
+      if (   !read_varint(data, end, len) || len > uint64_t(end - data)
+          || !codec.decode(data, data + len, line))
+          return false;
+      data += len;
+      if (!codec.split(line, board, text))
+          board.clear();
+      return true;
+  }
+
+  if ((type != DELTA_RECORD && type != DELTA_TEXT_RECORD) || board.empty() || !read_varint(data, end, changes))
+      return false;
+
+  for (size_t s = 0; changes--; ++s)
+  {
+      if (   !read_varint(data, end, gap) || gap >= board.size() - s
+          || !read_varint(data, end, code) || !codec.valid_code(code))
+          return false;
+      s += size_t(gap);
+      board[s] = uint16_t(code);
+  }
+  if (type == DELTA_TEXT_RECORD)
+  {
+      if (!read_varint(data, end, len) || len > uint64_t(end - data))
+          return false;
+      text.assign(reinterpret_cast<const char*>(data), size_t(len));
+      data += len;
+  }
+  line = codec.join(board, text);
+  return true;
+}
+
+
+/// AnalysisCache::AnalysisCache() loads the entries of the given context from
+/// the cache file and opens it for appending. The file starts with the magic
+/// and the version of the record layout. Each record consists of the context
+/// and position keys, the depth, the nodes, the side to move, the number of
+/// lines and the lines as pairs of move and score, in native byte order. A new
+/// or empty file gets the header, any other file without the current header is
+/// left untouched and the cache is not open. A truncated record at the end of
+/// the cache, e.g., after a crash, is dropped.
+
+AnalysisCache::AnalysisCache(const std::string& path, Key ctx) : context(ctx) {
+
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(CacheMagic)];
+  uint32_t version;
+
+  if (!in.is_open() || in.peek() == std::ifstream::traits_type::eof())
+  {
+      in.close();
+      std::vector<uint8_t> header(CacheMagic, CacheMagic + sizeof(CacheMagic));
+      write_raw(header, CacheVersion);
+      file.open(path, std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+      file.flush();
+      valid = bool(file);
+      return;
+  }
+
+  if (   !in.read(magic, sizeof(magic)) || std::memcmp(magic, CacheMagic, sizeof(magic))
+      || !read_raw(in, version) || version != CacheVersion)
+      return;
+
+  uint64_t recordContext, key, nodes;
+  int16_t depth;
+  uint8_t color;
+  uint16_t count;
+  std::streamoff end = in.tellg();
+
+  while (   read_raw(in, recordContext) && read_raw(in, key) && read_raw(in, depth)
+         && read_raw(in, nodes) && read_raw(in, color) && read_raw(in, count))
+  {
+      Analysis a;
+      a.depth = Depth(depth);
+      a.nodes = nodes;
+      a.sideToMove = Color(color);
+      a.lines.resize(count);
+
+      bool ok = true;
+      for (auto& line : a.lines)
+      {
+          int32_t move, value;
+          ok = ok && read_raw(in, move) && read_raw(in, value);
+          line = {Move(move), Value(value)};
+      }
+      if (!ok)
+          break;
+
+      end = in.tellg();
+      if (recordContext == context)
+          entries[key] = std::move(a);
+  }
+  in.close();
+
+  // Drop a partial record, so that new records are appended after the last complete one
+  std::error_code ec;
+  std::filesystem::resize_file(path, uintmax_t(end), ec);
+  file.open(path, std::ios::binary | std::ios::app);
+  valid = bool(file);
+}
+
+bool AnalysisCache::probe(Key key, Analysis& a) {
+
+  std::lock_guard<std::mutex> lk(mutex);
+  auto it = entries.find(key);
+  if (it == entries.end())
+      return false;
+  a = it->second;
+  return true;
+}
+
+void AnalysisCache::store(Key key, const Analysis& a) {
+
+  std::vector<uint8_t> record;
+  write_raw(record, uint64_t(context));
+  write_raw(record, uint64_t(key));
+  write_raw(record, int16_t(a.depth));
+  write_raw(record, uint64_t(a.nodes));
+  write_raw(record, uint8_t(a.sideToMove));
+  write_raw(record, uint16_t(a.lines.size()));
+  for (const auto& line : a.lines)
+  {
+      write_raw(record, int32_t(line.first));
+      write_raw(record, int32_t(line.second));
+  }
+
+  std::lock_guard<std::mutex> lk(mutex);
+  entries[key] = a;
+  file.write(reinterpret_cast<const char*>(record.data()), std::streamsize(record.size()));
+  file.flush();
+}
+
+} // namespace Book
@@ -0,0 +1,288 @@
+/*
+  Fairy-Stockfish, a UCI chess variant playing engine derived from Stockfish
+  Copyright (C) 2018-2021 Fabian Fichter
+
+  Fairy-Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Fairy-Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BOOKSTORE_H_INCLUDED
+#define BOOKSTORE_H_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "misc.h"
+#include "types.h"
+
+struct Variant;
+
+namespace Book {
+
+/// FenCodec packs FEN strings into a compact binary form. The board is stored
+/// as one occupancy bit per square plus a code per piece, where the codes are
+/// taken from the piece table of the variant. The remaining FEN fields are
+/// kept as text. FENs that can not be reproduced exactly are stored verbatim.
+
+class FenCodec {
+
+  std::string pieceChars; // Piece characters of the variant, code 0 is reserved
+  int files = 0, ranks = 0, codeBits = 0;
+
+public:
+  FenCodec() = default;
+  explicit FenCodec(const Variant* v);
+
+  void encode(const std::string& fen, std::vector<uint8_t>& out) const;
+  std::string decode(const uint8_t* data) const;
+  bool decode(const uint8_t* data, const uint8_t* end, std::string& fen) const;
+  bool split(const std::string& fen, std::vector<uint16_t>& board, std::string& text) const;
+  bool valid_code(uint64_t code) const { return !code || (code >> 2 && code >> 2 <= pieceChars.size()); }
+  std::string join(const std::vector<uint16_t>& board, const std::string& text) const;
+};
+
+
+/// Analysis is the result of a book search: the depth and the MultiPV lines,
+/// i.e., the root moves with their scores from the side to move's point of
+/// view, best first. A classification only finds out which moves are within
+/// a range of the best one, so apart from the best line its scores are only
+/// bounds that hold for this range.
+
+struct Analysis {
+  Depth depth = 0;
+  uint64_t nodes = 0;
+  Color sideToMove = WHITE;
+  Value classifyRange = VALUE_NONE; // VALUE_NONE for exact scores
+  std::vector<std::pair<Move, Value>> lines;
+};
+
+
+/// PositionStore is the working set of the book commands. Positions are kept
+/// in an open addressing hash table keyed by their Zobrist key, while the
+/// packed FENs are appended to a single arena, each optionally preceded by
+/// the analysis of the position. Entries stay in insertion order, which
+/// allows to filter the store in place.
+
+class PositionStore {
+
+  struct Entry {
+    Key key;
+    uint64_t offset; // Into the arena, the payload ends where the next one starts
+  };
+
+  const Variant* variant = nullptr;
+  FenCodec codec;
+  std::vector<Entry> entries;
+  std::vector<uint32_t> slots; // Entry index + 1, zero for an empty slot
+  std::vector<uint8_t> arena;
+
+  size_t find_slot(Key key) const;
+  void rehash(size_t slotCount);
+
+public:
+  bool insert(const Variant* v, Key key, const std::string& fen, const Analysis* a = nullptr);
+  bool contains(Key key) const;
+  void retain(const std::vector<char>& keep);
+  void clear();
+
+  size_t size() const { return entries.size(); }
+  Key key(size_t idx) const { return entries[idx].key; }
+  std::string fen(size_t idx) const;
+  bool analysis(size_t idx, Analysis& a) const;
+  std::vector<uint32_t> sorted() const;
+};
+
+
+/// SpillSorter collects positions within a memory budget. Whenever the budget
+/// is exceeded, the positions are sorted by key and spilled as a run to a
+/// temporary file. The runs and the positions still in memory are finally
+/// merged in the order of their keys, keeping the first of the duplicates, so
+/// that sets of positions much larger than the memory can be deduplicated.
+/// If a run cannot be written or read, the sorter fails and drops all its
+/// positions, which the caller has to check with good().
+
+class SpillSorter {
+
+  struct Entry {
+    Key key;
+    uint64_t offset; // Into the arena, where the length precedes the packed FEN
+  };
+
+  typedef std::function<bool(Key, const uint8_t*, uint32_t)> RecordSink;
+
+  FenCodec codec;
+  size_t budget;
+  std::string prefix;
+  std::vector<Entry> entries;
+  std::vector<uint8_t> arena, packed;
+  std::vector<std::string> runs;
+  size_t runNames = 0;
+  bool failed = false;
+
+  void sort_entries();
+  void spill();
+  std::string new_run();
+  bool write_run(const std::string& path, const std::function<bool(const RecordSink&)>& fill);
+  bool merge_runs(size_t first, size_t last, bool memory, const RecordSink& sink);
+  void clear();
+
+public:
+  SpillSorter(const Variant* v, size_t budgetBytes, const std::string& dir);
+  ~SpillSorter();
+
+  void add(Key key, const std::string& fen);
+  size_t merge(const std::function<void(Key, const std::string&)>& emit);
+  size_t run_count() const { return runs.size(); }
+  bool good() const { return !failed; }
+};
+
+
+/// BookFile is the binary book format, for lookups without parsing. The file
+/// starts with the magic, the number of positions, the offset of the index
+/// and the variant name, followed by the records of the positions and the
+/// index. The index holds pairs of position key and record offset, sorted by
+/// key, so that positions are found by a binary search in the mapped file.
+/// The keys are given by Book::file_key(), since Zobrist keys depend on the
+/// build.
+/// Each record starts with the length of the analysis, which is zero if there
+/// is none, followed by the analysis and the packed FEN. The analysis holds
+/// the depth, the nodes and the moves in UCI notation with their scores from
+/// the side to move's point of view, best first. The scores are centipawns
+/// like the ce operation of EPD. Numbers in the header and the index are
+/// little-endian, and the lengths and the analysis are varints.
+
+struct BookMove {
+  std::string move;
+  int score; // Centipawns
+};
+
+class BookFile {
+
+  MappedFile file;
+  FenCodec codec;
+  std::string variantName;
+  const uint8_t* records = nullptr;
+  const uint8_t* index = nullptr;
+  size_t count = 0;
+  bool valid = false;
+
+  const uint8_t* record(size_t idx) const;
+
+public:
+  explicit BookFile(const std::string& path);
+
+  bool is_open() const { return valid; }
+  const std::string& variant() const { return variantName; }
+  size_t size() const { return count; }
+  Key key(size_t idx) const;
+  bool find(Key k, size_t& idx) const;
+  bool fen(size_t idx, std::string& fen) const;
+  bool moves(size_t idx, std::vector<BookMove>& moves, Depth& depth, uint64_t& nodes) const;
+};
+
+class BookFileWriter {
+
+  std::string path;
+  std::ofstream file;
+  FenCodec codec;
+  std::vector<std::pair<Key, uint64_t>> index;
+  uint64_t offset = 0;
+
+public:
+  BookFileWriter(const std::string& path, const Variant* v, const std::string& name);
+
+  void add(Key key, const std::string& fen, const std::vector<BookMove>* moves = nullptr,
+           Depth depth = 0, uint64_t nodes = 0);
+  bool finish();
+};
+
+
+/// StreamWriter and StreamReader handle the compressed stream format for EPD
+/// archives. After the magic and the variant name, every line is a record.
+/// A full record holds the packed line, while a delta record only holds the
+/// squares that differ from the board of the previous line, and the rest of
+/// the line if that differs, too. Consecutive lines of the generators are
+/// mostly siblings or parent and child, so that most records are deltas of a
+/// few squares.
+
+class StreamWriter {
+
+  std::ofstream file;
+  FenCodec codec;
+  std::vector<uint16_t> board, previous;
+  std::string text, previousText;
+  std::vector<uint8_t> record, full;
+  bool hasPrevious = false;
+
+public:
+  StreamWriter(const std::string& path, const Variant* v, const std::string& name);
+
+  void write(const std::string& line);
+  bool close();
+};
+
+class StreamReader {
+
+  MappedFile file;
+  FenCodec codec;
+  std::string variantName;
+  std::vector<uint16_t> board;
+  std::string text;
+  const uint8_t* data = nullptr;
+  const uint8_t* end = nullptr;
+  bool failed = false;
+
+  bool read_record(std::string& line);
+
+public:
+  explicit StreamReader(const std::string& path);
+
+  bool is_open() const { return data != nullptr; }
+  bool corrupt() const { return failed; }
+  const std::string& variant() const { return variantName; }
+  bool next(std::string& line);
+};
+
+
+/// AnalysisCache keeps the analyses of the book searches in a file, so that
+/// later runs with the same search settings, e.g., with only the thresholds
+/// changed, do not need to search again. Entries are keyed by the position
+/// and by a context key for the variant and the search settings. New entries
+/// are appended to the file, and only the entries of the context are loaded.
+
+class AnalysisCache {
+
+  std::mutex mutex;
+  std::unordered_map<Key, Analysis> entries;
+  std::ofstream file;
+  Key context;
+  bool valid = false;
+
+public:
+  AnalysisCache(const std::string& path, Key ctx);
+
+  bool is_open() const { return valid; }
+
+  bool probe(Key key, Analysis& a);
+  void store(Key key, const Analysis& a);
+  size_t size() const { return entries.size(); }
+};
+
+} // namespace Book
+
+#endif // #ifndef BOOKSTORE_H_INCLUDED
@@ -51,6 +51,13 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 #include <sys/mman.h>
 #endif
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32))
 #define POSIXALIGNEDALLOC
 #include <stdlib.h>
@@ -469,6 +476,82 @@ void aligned_large_pages_free(void *mem) {
 #endif
 
 
+/// MappedFile::MappedFile() maps the given file. An empty file is open but
+/// has no data, while is_open() is false if the file can not be mapped.
+
+#ifndef _WIN32
+
+MappedFile::MappedFile(const std::string& fname) {
+
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd == -1)
+      return;
+
+  struct stat statbuf;
+  fstat(fd, &statbuf);
+  length = size_t(statbuf.st_size);
+
+  if (length)
+  {
+      void* mem = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED)
+      {
+#if defined(MADV_SEQUENTIAL)
+          madvise(mem, length, MADV_SEQUENTIAL);
+#endif
+          base = static_cast<const char*>(mem);
+      }
+  }
+  ::close(fd);
+
+  opened = base || !length;
+  if (!opened)
+      length = 0;
+}
+
+MappedFile::~MappedFile() {
+
+  if (base)
+      munmap(const_cast<char*>(base), length);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& fname) {
+
+  HANDLE fd = CreateFile(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (fd == INVALID_HANDLE_VALUE)
+      return;
+
+  DWORD size_high;
+  DWORD size_low = GetFileSize(fd, &size_high);
+  length = size_t((uint64_t(size_high) << 32) | size_low);
+
+  if (length)
+  {
+      mapping = CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high, size_low, nullptr);
+      if (mapping)
+          base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  }
+  CloseHandle(fd);
+
+  opened = base || !length;
+  if (!opened)
+      length = 0;
+}
+
+MappedFile::~MappedFile() {
+
+  if (base)
+      UnmapViewOfFile(base);
+  if (mapping)
+      CloseHandle(mapping);
+}
+
+#endif
+
+
 namespace WinProcGroup {
 
 #ifndef _WIN32
@@ -126,6 +126,29 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 #endif
 }
 
+/// MappedFile maps a whole file read-only into memory, e.g., to parse large
+/// input files in parallel. The mapping is released by the destructor.
+
+class MappedFile {
+
+  const char* base = nullptr;
+  size_t length = 0;
+  bool opened = false;
+#ifdef _WIN32
+  void* mapping = nullptr;
+#endif
+
+public:
+  explicit MappedFile(const std::string& fname);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const { return opened; }
+  const char* data() const { return base; }
+  size_t size() const { return length; }
+};
+
 /// Under Windows it is not possible for a process to run on more than one
 /// logical processor group. This usually means to be limited to use max 64
 /// cores. To overcome this, some special platform specific API should be
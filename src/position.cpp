@@ -1654,7 +1654,9 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
       }
 
       st->gatesBB[us] ^= gate;
-      k ^= Zobrist::psq[gating_piece][gate];
+      k ^=  Zobrist::psq[gating_piece][gate]
+          ^ Zobrist::inHand[gating_piece][pieceCountInHand[us][gating_type(m)] + 1]
+          ^ Zobrist::inHand[gating_piece][pieceCountInHand[us][gating_type(m)]];
       st->materialKey ^= Zobrist::psq[gating_piece][pieceCount[gating_piece]];
       st->nonPawnMaterial[us] += PieceValue[MG][gating_piece];
   }
@@ -4,8 +4,12 @@
 */
 
 #include <Python.h>
+#include <map>
+#include <memory>
 #include <sstream>
+#include <sys/stat.h>
 
+#include "book.h"
 #include "misc.h"
 #include "types.h"
 #include "bitboard.h"
@@ -325,6 +329,223 @@ extern "C" PyObject* pyffish_validateFen(PyObject* self, PyObject *args) {
     return Py_BuildValue("i", fen::validate_fen(std::string(fen), variants.find(std::string(variant))->second));
 }
 
+// INPUT variant, fen list
+// The positions are evaluated one by one, this only saves the calls from Python
+extern "C" PyObject* pyffish_evaluate(PyObject* self, PyObject *args) {
+    PyObject *fenList;
+    const char *variant;
+    int chess960 = false;
+    if (!PyArg_ParseTuple(args, "sO!|p", &variant, &PyList_Type, &fenList, &chess960)) {
+        return NULL;
+    }
+
+    const Variant* v = variants.find(std::string(variant))->second;
+    PSQT::init(v);
+    Options["UCI_Chess960"] = chess960;
+
+    // The positions share a single state, since only their evaluations are needed
+    int numFens = PyList_Size(fenList);
+    PyObject* evals = PyList_New(numFens);
+    StateInfo st;
+    Position pos;
+    for (int i = 0; i < numFens; i++)
+    {
+        PyObject *FenStr = PyUnicode_AsEncodedString(PyList_GetItem(fenList, i), "UTF-8", "strict");
+        pos.set(v, std::string(PyBytes_AS_STRING(FenStr)), chess960, &st, Threads.main());
+        Py_XDECREF(FenStr);
+
+        // The static evaluation is meaningless in check. Like the EPD output
+        // of the book, it is given in centipawns.
+        PyList_SET_ITEM(evals, i, pos.checkers() ? Py_BuildValue("")
+                                                 : Py_BuildValue("i", Eval::evaluate(pos) * 100 / PawnValueEg));
+    }
+
+    return evals;
+}
+
+// Binary books stay mapped once opened, so that lookups need no parsing. A
+// book is mapped again once its file has been replaced or changed.
+const Book::BookFile* openBook(const char *path) {
+    struct MappedBook {
+        std::unique_ptr<Book::BookFile> file;
+        struct stat status;
+    };
+    static std::map<std::string, MappedBook> books;
+
+    struct stat status;
+    if (stat(path, &status))
+    {
+        books.erase(std::string(path));
+        PyErr_SetString(PyExc_ValueError, (std::string("Could not open book '") + path + "'").c_str());
+        return nullptr;
+    }
+
+    auto& book = books[std::string(path)];
+    if (   !book.file || !book.file->is_open()
+        || status.st_ino != book.status.st_ino || status.st_size != book.status.st_size
+        || status.st_mtime != book.status.st_mtime)
+    {
+        book.file.reset(new Book::BookFile(std::string(path)));
+        book.status = status;
+    }
+    if (!book.file->is_open())
+    {
+        PyErr_SetString(PyExc_ValueError, (std::string("Could not open book '") + path + "'").c_str());
+        return nullptr;
+    }
+    return book.file.get();
+}
+
+PyObject* bookMoves(const Book::BookFile* book, size_t idx) {
+    std::vector<Book::BookMove> moves;
+    Depth depth;
+    uint64_t nodes;
+    book->moves(idx, moves, depth, nodes);
+
+    PyObject* moveList = PyList_New(moves.size());
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        PyObject* move = Py_BuildValue("(si)", moves[i].move.c_str(), moves[i].score);
+        if (!move) // Corrupt move text
+        {
+            Py_DECREF(moveList);
+            return NULL;
+        }
+        PyList_SET_ITEM(moveList, i, move);
+    }
+    return moveList;
+}
+
+// INPUT book path
+extern "C" PyObject* pyffish_bookSize(PyObject* self, PyObject *args) {
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+
+    const Book::BookFile* book = openBook(path);
+    if (!book)
+        return NULL;
+
+    return Py_BuildValue("n", Py_ssize_t(book->size()));
+}
+
+// INPUT book path, index
+extern "C" PyObject* pyffish_bookPosition(PyObject* self, PyObject *args) {
+    const char *path;
+    Py_ssize_t idx;
+    if (!PyArg_ParseTuple(args, "sn", &path, &idx)) {
+        return NULL;
+    }
+
+    const Book::BookFile* book = openBook(path);
+    if (!book)
+        return NULL;
+    if (idx < 0 || size_t(idx) >= book->size())
+    {
+        PyErr_SetString(PyExc_IndexError, "Book index out of range");
+        return NULL;
+    }
+
+    std::string fen;
+    if (!book->fen(size_t(idx), fen))
+    {
+        PyErr_SetString(PyExc_ValueError, (std::string("Corrupt record in book '") + path + "'").c_str());
+        return NULL;
+    }
+
+    PyObject* moveList = bookMoves(book, size_t(idx));
+    if (!moveList)
+        return NULL;
+    PyObject* result = Py_BuildValue("(sO)", fen.c_str(), moveList);
+    Py_DECREF(moveList);
+    return result;
+}
+
+// INPUT book path, fen
+extern "C" PyObject* pyffish_bookLookup(PyObject* self, PyObject *args) {
+    const char *path, *fen;
+    int chess960 = false;
+    if (!PyArg_ParseTuple(args, "ss|p", &path, &fen, &chess960)) {
+        return NULL;
+    }
+
+    const Book::BookFile* book = openBook(path);
+    if (!book)
+        return NULL;
+
+    StateInfo st;
+    Position pos;
+    pos.set(variants.find(book->variant())->second, std::string(fen), chess960, &st, Threads.main());
+
+    size_t idx;
+    if (!book->find(Book::file_key(pos), idx))
+        return Py_BuildValue("");
+
+    return bookMoves(book, idx);
+}
+
+// INPUT stream path, variant, line list
+extern "C" PyObject* pyffish_writeStream(PyObject* self, PyObject *args) {
+    PyObject *lineList;
+    const char *path, *variant;
+    if (!PyArg_ParseTuple(args, "ssO!", &path, &variant, &PyList_Type, &lineList)) {
+        return NULL;
+    }
+
+    Book::StreamWriter writer(std::string(path), variants.find(std::string(variant))->second, std::string(variant));
+    int numLines = PyList_Size(lineList);
+    for (int i = 0; i < numLines; i++)
+    {
+        PyObject *LineStr = PyUnicode_AsEncodedString(PyList_GetItem(lineList, i), "UTF-8", "strict");
+        writer.write(std::string(PyBytes_AS_STRING(LineStr)));
+        Py_XDECREF(LineStr);
+    }
+
+    if (!writer.close())
+    {
+        PyErr_SetString(PyExc_IOError, (std::string("Could not write stream '") + path + "'").c_str());
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// INPUT stream path
+extern "C" PyObject* pyffish_readStream(PyObject* self, PyObject *args) {
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+
+    Book::StreamReader reader((std::string(path)));
+    if (!reader.is_open())
+    {
+        PyErr_SetString(PyExc_ValueError, (std::string("Could not open stream '") + path + "'").c_str());
+        return NULL;
+    }
+
+    PyObject* lines = PyList_New(0);
+    std::string line;
+    while (reader.next(line))
+    {
+        PyObject* lineStr = Py_BuildValue("s", line.c_str());
+        if (!lineStr)
+        {
+            Py_DECREF(lines);
+            return NULL;
+        }
+        PyList_Append(lines, lineStr);
+        Py_DECREF(lineStr);
+    }
+    if (reader.corrupt())
+    {
+        Py_DECREF(lines);
+        PyErr_SetString(PyExc_ValueError, (std::string("Corrupt stream '") + path + "'").c_str());
+        return NULL;
+    }
+    return lines;
+}
+
 
 static PyMethodDef PyFFishMethods[] = {
     {"version", (PyCFunction)pyffish_version, METH_NOARGS, "Get package version."},
@@ -343,6 +564,12 @@ static PyMethodDef PyFFishMethods[] = {
     {"is_optional_game_end", (PyCFunction)pyffish_isOptionalGameEnd, METH_VARARGS, "Get result from given FEN it rules enable game end by player."},
     {"has_insufficient_material", (PyCFunction)pyffish_hasInsufficientMaterial, METH_VARARGS, "Checks for insufficient material."},
     {"validate_fen", (PyCFunction)pyffish_validateFen, METH_VARARGS, "Validate an input FEN."},
+    {"evaluate", (PyCFunction)pyffish_evaluate, METH_VARARGS, "Get the static evaluations in centipawns of a list of FENs, one position at a time, from the side to move's point of view."},
+    {"book_size", (PyCFunction)pyffish_bookSize, METH_VARARGS, "Get the number of positions of a binary book."},
+    {"book_position", (PyCFunction)pyffish_bookPosition, METH_VARARGS, "Get the FEN and the moves with centipawn scores of a binary book position by index."},
+    {"book_lookup", (PyCFunction)pyffish_bookLookup, METH_VARARGS, "Get the moves with centipawn scores of a FEN from a binary book, or None if it is not in the book."},
+    {"write_stream", (PyCFunction)pyffish_writeStream, METH_VARARGS, "Write a list of EPD lines to a compressed stream."},
+    {"read_stream", (PyCFunction)pyffish_readStream, METH_VARARGS, "Get the list of EPD lines of a compressed stream."},
     {NULL, NULL, 0, NULL},  // sentinel
 };
 
@@ -387,7 +614,7 @@ PyMODINIT_FUNC PyInit_pyffish() {
     Bitboards::init();
     Position::init();
     Bitbases::init();
-    Search::init();
+    Search::init(1);
     Threads.set(Options["Threads"]);
     Search::clear(); // After threads are up
 
@@ -191,12 +191,13 @@ namespace {
 } // namespace
 
 
-/// Search::init() is called at startup to initialize various lookup tables
+/// Search::init() is called at startup to initialize various lookup tables.
+/// The reductions depend on the number of threads searching the same position.
 
-void Search::init() {
+void Search::init(size_t threads) {
 
   for (int i = 1; i < MAX_MOVES; ++i)
-      Reductions[i] = int((21.3 + 2 * std::log(Threads.size())) * std::log(i + 0.25 * std::log(i)));
+      Reductions[i] = int((21.3 + 2 * std::log(threads)) * std::log(i + 0.25 * std::log(i)));
 }
 
 
@@ -273,6 +274,11 @@ void MainThread::search() {
   while (!Threads.stop && (ponder || Limits.infinite))
   {} // Busy wait for a stop or a ponder reset
 
+  // With split MultiPV lines, the other threads are still searching theirs
+  // to the requested depth.
+  if (Threads.pvSplit && Limits.depth)
+      Threads.wait_for_search_finished();
+
   // Stop the threads if not already stopped (also raise the stop if
   // "ponderhit" just reset Threads.ponder).
   Threads.stop = true;
@@ -287,6 +293,39 @@ void MainThread::search() {
 
   bestThread = this;
 
+  // Merge the MultiPV lines of the threads, where unfinished lines count
+  // with their previous score. The other root moves come last.
+  if (Threads.pvSplit)
+  {
+      Search::RootMoves lines, others;
+      pvCount = 0;
+
+      for (size_t i = 0; i < Threads.pvSplit; ++i)
+      {
+          Thread* th = Threads[i];
+          completedDepth = std::min(completedDepth, th->completedDepth);
+          pvCount += th->pvCount;
+
+          for (size_t j = 0; j < th->rootMoves.size(); ++j)
+          {
+              RootMove rm = th->rootMoves[j];
+              if (j >= th->pvCount)
+                  others.push_back(rm);
+              else
+              {
+                  if (rm.score == -VALUE_INFINITE)
+                      rm.score = rm.previousScore;
+                  lines.push_back(rm);
+              }
+          }
+      }
+
+      std::stable_sort(lines.begin(), lines.end());
+      lines.insert(lines.end(), others.begin(), others.end());
+      rootMoves = lines;
+      pvCount = std::min(pvCount, size_t(Options["MultiPV"]));
+  }
+
   if (   int(Options["MultiPV"]) == 1
       && !Limits.depth
       && !(Skill(Options["Skill Level"]).enabled() || int(Options["UCI_LimitStrength"]))
@@ -295,8 +334,8 @@ void MainThread::search() {
 
   bestPreviousScore = bestThread->rootMoves[0].score;
 
-  // Send again PV info if we have a new best thread
-  if (bestThread != this)
+  // Send again PV info if we have a new best thread or merged lines
+  if (bestThread != this || Threads.pvSplit)
       sync_cout << UCI::pv(bestThread->rootPos, bestThread->completedDepth, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
 
   if (Options["Protocol"] == "xboard")
@@ -342,7 +381,7 @@ void Thread::search() {
   Value bestValue, alpha, beta, delta;
   Move  lastBestMove = MOVE_NONE;
   Depth lastBestMoveDepth = 0;
-  MainThread* mainThread = (this == Threads.main() ? Threads.main() : nullptr);
+  MainThread* mainThread = (this == Threads.main() && !worker ? Threads.main() : nullptr);
   double timeReduction = 1, totBestMoveChanges = 0;
   Color us = rootPos.side_to_move();
   int iterIdx = 0;
@@ -369,7 +408,7 @@ void Thread::search() {
   std::copy(&lowPlyHistory[2][0], &lowPlyHistory.back().back() + 1, &lowPlyHistory[0][0]);
   std::fill(&lowPlyHistory[MAX_LPH - 2][0], &lowPlyHistory.back().back() + 1, 0);
 
-  size_t multiPV = size_t(Options["MultiPV"]);
+  size_t multiPV = worker && workerLimits.multiPV ? size_t(workerLimits.multiPV) : size_t(Options["MultiPV"]);
 
   // Pick integer skill levels, but non-deterministically round up or down
   // such that the average integer skill corresponds to the input floating point one.
@@ -390,6 +429,12 @@ void Thread::search() {
       multiPV = std::max(multiPV, (size_t)4);
 
   multiPV = std::min(multiPV, rootMoves.size());
+  pvCount = multiPV;
+  Value pvRange = worker ? workerLimits.pvRange : Limits.pvRange;
+  bool ranged = pvRange < VALUE_INFINITE;
+  bool classify = (worker ? workerLimits.classify : Limits.classify) && ranged && !Threads.pvSplit;
+  Value threshold = -VALUE_INFINITE;
+  classifyThreshold = previousClassifyThreshold = VALUE_NONE;
   ttHitAverage = TtHitAverageWindow * TtHitAverageResolution / 2;
 
   int ct = int(Options["Contempt"]) * PawnValueEg / 100; // From centipawns
@@ -411,7 +456,8 @@ void Thread::search() {
   // Iterative deepening loop until requested to stop or the target depth is reached
   while (   ++rootDepth < MAX_PLY
          && !Threads.stop
-         && !(Limits.depth && mainThread && rootDepth > Limits.depth))
+         && !(Limits.depth && (mainThread || Threads.pvSplit) && rootDepth > Limits.depth)
+         && !(worker && (workerStop || (workerLimits.depth && rootDepth > workerLimits.depth))))
   {
       // Age out PV variability metric
       if (mainThread)
@@ -421,6 +467,7 @@ void Thread::search() {
       // all the move scores except the (new) PV are set to -VALUE_INFINITE.
       for (RootMove& rm : rootMoves)
           rm.previousScore = rm.score;
+      previousClassifyThreshold = classifyThreshold;
 
       size_t pvFirst = 0;
       pvLast = 0;
@@ -429,7 +476,7 @@ void Thread::search() {
          searchAgainCounter++;
 
       // MultiPV loop. We perform a full root search for each PV line
-      for (pvIdx = 0; pvIdx < multiPV && !Threads.stop; ++pvIdx)
+      for (pvIdx = 0; pvIdx < multiPV && !Threads.stop && !(worker && workerStop); ++pvIdx)
       {
           if (pvIdx == pvLast)
           {
@@ -446,6 +493,11 @@ void Thread::search() {
           if (rootDepth >= 4)
           {
               Value prev = rootMoves[pvIdx].previousScore;
+
+              // Lines beyond the range were not searched in the last iteration
+              if (ranged && prev == -VALUE_INFINITE && pvIdx > 0)
+                  prev = rootMoves[pvIdx - 1].score;
+
               delta = Value(17 * (1 + rootPos.captures_to_hand()));
               alpha = std::max(prev - delta,-VALUE_INFINITE);
               beta  = std::min(prev + delta, VALUE_INFINITE);
@@ -455,6 +507,15 @@ void Thread::search() {
 
               contempt = (us == WHITE ?  make_score(dct, dct / 2)
                                       : -make_score(dct, dct / 2));
+
+              // In classification mode, the lines after the first one only
+              // test with a null window whether the best of the remaining
+              // moves is within the range of the best move.
+              if (classify && pvIdx > 0)
+              {
+                  alpha = threshold - 1;
+                  beta  = threshold;
+              }
           }
 
           // Start with a small aspiration window and, in the case of a fail
@@ -477,7 +538,10 @@ void Thread::search() {
               // If search has been stopped, we break immediately. Sorting is
               // safe because RootMoves is still valid, although it refers to
               // the previous iteration.
-              if (Threads.stop)
+              if (Threads.stop || (worker && workerStop))
+                  break;
+
+              if (classify && pvIdx > 0 && rootDepth >= 4)
                   break;
 
               // When failing high/low give some update (without cluttering
@@ -515,14 +579,48 @@ void Thread::search() {
           // Sort the PV lines searched so far and update the GUI
           std::stable_sort(rootMoves.begin() + pvFirst, rootMoves.begin() + pvIdx + 1);
 
-          if (    mainThread
-              && (Threads.stop || pvIdx + 1 == multiPV || Time.elapsed() > 3000))
+          // With a range limit, no further lines are opened once the last one
+          // has fallen out of the range of the best one, since the remaining
+          // moves are not expected to score any better.
+          if (pvIdx == 0)
+          {
+              threshold = std::max(rootMoves[0].score - pvRange, -VALUE_INFINITE + 1);
+              classifyThreshold = classify && rootDepth >= 4 ? threshold : VALUE_NONE;
+          }
+
+          bool outOfRange =    ranged && pvIdx + 1 < multiPV
+                            && !Threads.stop && !(worker && workerStop)
+                            && (classify && pvIdx > 0 && rootDepth >= 4 ? bestValue < threshold
+                                : rootMoves[pvIdx].score < rootMoves[0].score - pvRange);
+
+          pvCount = outOfRange ? pvIdx + 1 : std::max(pvCount, pvIdx + 1);
+
+          if (    mainThread && !Threads.pvSplit
+              && (Threads.stop || pvIdx + 1 == multiPV || outOfRange || Time.elapsed() > 3000))
               sync_cout << UCI::pv(rootPos, rootDepth, alpha, beta) << sync_endl;
+
+          if (outOfRange)
+          {
+              ++pvIdx;
+              break;
+          }
       }
 
-      if (!Threads.stop)
+      if (!Threads.stop && !(worker && workerStop))
           completedDepth = rootDepth;
 
+      // With split MultiPV lines, the lines are only merged at the end, so
+      // meanwhile the main thread only reports the progress.
+      if (mainThread && Threads.pvSplit && !Threads.stop && Options["Protocol"] != "xboard")
+      {
+          TimePoint elapsed = Time.elapsed() + 1;
+          uint64_t nodesSearched = Threads.nodes_searched();
+          sync_cout << "info depth " << rootDepth
+                    << " nodes " << nodesSearched
+                    << " nps " << nodesSearched * 1000 / elapsed
+                    << " time " << elapsed << sync_endl;
+      }
+
       if (rootMoves[0].pv[0] != lastBestMove) {
          lastBestMove = rootMoves[0].pv[0];
          lastBestMoveDepth = rootDepth;
@@ -566,7 +664,7 @@ void Thread::search() {
 
           // Cap used time in case of a single legal move for a better viewer experience in tournaments
           // yielding correct scores and sufficiently fast moves.
-          if (rootMoves.size() == 1)
+          if (rootMoves.size() == 1 && !Threads.pvSplit)
               totalTime = std::min(500.0, totalTime);
 
           if (completedDepth >= 8 && rootPos.two_boards() && Options["Protocol"] == "xboard")
@@ -688,7 +786,9 @@ namespace {
     maxValue = VALUE_INFINITE;
 
     // Check for the available remaining time
-    if (thisThread == Threads.main())
+    if (thisThread->worker)
+        thisThread->check_worker_limits();
+    else if (thisThread == Threads.main())
         static_cast<MainThread*>(thisThread)->check_time();
 
     // Used to send selDepth info to GUI (selDepth counts from 1, ply from 0)
@@ -703,6 +803,7 @@ namespace {
 
         // Step 2. Check for aborted search and immediate draw
         if (   Threads.stop.load(std::memory_order_relaxed)
+            || thisThread->workerStop
             || ss->ply >= MAX_PLY)
             return (ss->ply >= MAX_PLY && !ss->inCheck) ? evaluate(pos)
                                                         : value_draw(pos.this_thread());
@@ -1093,7 +1194,7 @@ moves_loop: // When in check, search starts from here
 
       ss->moveCount = ++moveCount;
 
-      if (rootNode && thisThread == Threads.main() && Time.elapsed() > 3000 && Options["Protocol"] != "xboard")
+      if (rootNode && thisThread == Threads.main() && !thisThread->worker && Time.elapsed() > 3000 && Options["Protocol"] != "xboard")
           sync_cout << "info depth " << depth
                     << " currmove " << UCI::move(pos, move)
                     << " currmovenumber " << moveCount + thisThread->pvIdx << sync_endl;
@@ -1392,7 +1493,7 @@ moves_loop: // When in check, search starts from here
       // Finished searching the move. If a stop occurred, the return value of
       // the search cannot be trusted, and we return immediately without
       // updating best move, PV and TT.
-      if (Threads.stop.load(std::memory_order_relaxed))
+      if (Threads.stop.load(std::memory_order_relaxed) || thisThread->workerStop)
           return VALUE_ZERO;
 
       if (rootNode)
@@ -1982,7 +2083,7 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
   TimePoint elapsed = Time.elapsed() + 1;
   const RootMoves& rootMoves = pos.this_thread()->rootMoves;
   size_t pvIdx = pos.this_thread()->pvIdx;
-  size_t multiPV = std::min((size_t)Options["MultiPV"], rootMoves.size());
+  size_t multiPV = std::min({(size_t)Options["MultiPV"], pos.this_thread()->pvCount, rootMoves.size()});
   uint64_t nodesSearched = Threads.nodes_searched();
   uint64_t tbHits = Threads.tb_hits() + (TB::RootInTB ? rootMoves.size() : 0);
 
@@ -2029,8 +2130,14 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
       if (Options["UCI_ShowWDL"])
           ss << UCI::wdl(v, pos.game_ply());
 
+      // The classified lines only have bounds against the threshold
+      Value threshold = updated ? pos.this_thread()->classifyThreshold
+                                : pos.this_thread()->previousClassifyThreshold;
+
       if (!tb && i == pvIdx)
           ss << (v >= beta ? " lowerbound" : v <= alpha ? " upperbound" : "");
+      else if (!tb && i > 0 && threshold != VALUE_NONE)
+          ss << (v >= threshold ? " lowerbound" : " upperbound");
 
       ss << " nodes "    << nodesSearched
          << " nps "      << nodesSearched * 1000 / elapsed;
@@ -85,8 +85,10 @@ struct LimitsType {
 
   LimitsType() { // Init explicitly due to broken value-initialization of non POD in MSVC
     time[WHITE] = time[BLACK] = inc[WHITE] = inc[BLACK] = npmsec = movetime = TimePoint(0);
-    movestogo = depth = mate = perft = infinite = 0;
+    movestogo = depth = mate = perft = infinite = classify = multiPV = 0;
     nodes = 0;
+    pvRange = VALUE_INFINITE;
+    firstMove = MOVE_NONE;
   }
 
   bool use_time_management() const {
@@ -95,13 +97,15 @@ struct LimitsType {
 
   std::vector<Move> searchmoves, banmoves;
   TimePoint time[COLOR_NB], inc[COLOR_NB], npmsec, movetime, startTime;
-  int movestogo, depth, mate, perft, infinite;
+  int movestogo, depth, mate, perft, infinite, classify, multiPV;
   int64_t nodes;
+  Value pvRange; // MultiPV lines are only opened while within this range of the best one
+  Move firstMove; // Root move to search first, e.g. from the PV of an earlier search
 };
 
 extern LimitsType Limits;
 
-void init();
+void init(size_t threads);
 void clear();
 
 } // namespace Search
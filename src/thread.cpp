@@ -19,6 +19,7 @@
 #include <cassert>
 
 #include <algorithm> // For std::count
+#include "evaluate.h"
 #include "movegen.h"
 #include "search.h"
 #include "thread.h"
@@ -91,6 +92,12 @@ void Thread::wait_for_search_finished() {
   cv.wait(lk, [&]{ return !searching; });
 }
 
+bool Thread::wait_for_search_finished(TimePoint ms) {
+
+  std::unique_lock<std::mutex> lk(mutex);
+  return cv.wait_for(lk, std::chrono::milliseconds(ms), [&]{ return !searching; });
+}
+
 
 /// Thread::idle_loop() is where the thread is parked, blocked on the
 /// condition variable, when it has no work to do.
@@ -123,10 +130,68 @@ void Thread::idle_loop() {
 
       lk.unlock();
 
-      search();
+      if (job)
+      {
+          worker = true;
+          job(*this);
+          worker = workerStop = false;
+          job = nullptr;
+      }
+      else
+          search();
   }
 }
 
+
+/// Thread::search_position() searches the given position with this thread only,
+/// independently of what the other threads are doing. It is meant to be called
+/// from a job started with ThreadPool::run_workers(). The result is left in
+/// rootPos and rootMoves. As the workers share the TT, the results depend on
+/// what the other workers searched before, and thereby on their number and
+/// timing.
+
+void Thread::search_position(const Variant* v, const std::string& fen, const Search::LimitsType& limits) {
+
+  assert(worker);
+
+  workerLimits = limits;
+  workerLimits.startTime = now();
+  workerStop = false;
+  workerCalls = 0;
+
+  nodes = tbHits = nmpMinPly = bestMoveChanges = 0;
+  rootDepth = completedDepth = 0;
+  rootPos.set(v, fen, Options["UCI_Chess960"], &rootState, this);
+  rootMoves.clear();
+
+  for (const auto& m : MoveList<LEGAL>(rootPos))
+      if (limits.searchmoves.empty() || std::count(limits.searchmoves.begin(), limits.searchmoves.end(), m))
+          rootMoves.emplace_back(m);
+
+  auto first = std::find(rootMoves.begin(), rootMoves.end(), limits.firstMove);
+  if (first != rootMoves.end())
+      std::rotate(rootMoves.begin(), first, first + 1);
+
+  if (!rootMoves.empty())
+      Thread::search();
+}
+
+
+/// Thread::check_worker_limits() is the counterpart of MainThread::check_time()
+/// for independent searches. It only stops the search of this thread.
+
+void Thread::check_worker_limits() {
+
+  if (--workerCalls > 0)
+      return;
+
+  workerCalls = workerLimits.nodes ? std::min(1024, int(workerLimits.nodes / 1024)) : 1024;
+
+  if (   (workerLimits.movetime && now() - workerLimits.startTime >= workerLimits.movetime)
+      || (workerLimits.nodes && nodes.load(std::memory_order_relaxed) >= (uint64_t)workerLimits.nodes))
+      workerStop = true;
+}
+
 /// ThreadPool::set() creates/destroys threads to match the requested number.
 /// Created and launched threads will immediately go to sleep in idle_loop.
 /// Upon resizing, threads are recreated to allow for binding if necessary.
@@ -151,7 +216,7 @@ void ThreadPool::set(size_t requested) {
       TT.resize(size_t(Options["Hash"]));
 
       // Init thread number dependent search params.
-      Search::init();
+      Search::init(size());
   }
 }
 
@@ -203,11 +268,23 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
   // be deduced from a fen string, so set() clears them and they are set from
   // setupStates->back() later. The rootState is per thread, earlier states are shared
   // since they are read-only.
-  for (Thread* th : *this)
+  // With SplitMultiPV, each thread only searches the MultiPV lines of its
+  // share of the root moves, and the main thread merges them in the end.
+  // Surplus threads help with the share of another thread.
+  pvSplit = std::min(size(), rootMoves.size());
+  if (   pvSplit < 2 || !Options["SplitMultiPV"] || int(Options["MultiPV"]) == 1
+      || int(Options["Skill Level"]) < 20 || Options["UCI_LimitStrength"])
+      pvSplit = 0;
+
+  for (size_t i = 0; i < size(); ++i)
   {
+      Thread* th = at(i);
       th->nodes = th->tbHits = th->nmpMinPly = th->bestMoveChanges = 0;
       th->rootDepth = th->completedDepth = 0;
-      th->rootMoves = rootMoves;
+      th->rootMoves.clear();
+      for (size_t j = 0; j < rootMoves.size(); ++j)
+          if (!pvSplit || j % pvSplit == i % pvSplit)
+              th->rootMoves.push_back(rootMoves[j]);
       th->rootPos.set(pos.variant(), pos.fen(), pos.is_chess960(), &th->rootState, th);
       th->rootState = setupStates->back();
   }
@@ -215,6 +292,65 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
   main()->start_searching();
 }
 
+/// ThreadPool::run_workers() runs the given job on all threads in parallel and
+/// returns once every thread has finished it. Within the job, each thread can
+/// search positions on its own with Thread::search_position(). While waiting,
+/// the optional monitor is called by the calling thread every interval ms.
+/// The calling thread also ages the TT entries of the earlier positions: it
+/// starts a new TT generation whenever the current one fills half of the TT,
+/// so that even in long runs the generations do not cycle before their
+/// entries are replaced.
+
+void ThreadPool::run_workers(const std::function<void(Thread&)>& job,
+                             const std::function<void()>& monitor, TimePoint interval) {
+
+  main()->wait_for_search_finished();
+
+  Search::LimitsType limits;
+  limits.startTime = now();
+
+  stop = abort = false;
+  increaseDepth = true;
+  pvSplit = 0;
+  Search::Limits = limits; // Reset any limits of a previous 'go'
+  Search::init(1); // Each thread searches on its own
+
+  // The evaluation and its info message only need a check when it changed
+  static std::string verified;
+  std::string evaluation = std::to_string(Eval::useNNUE) + std::string(Options["EvalFile"]) + Eval::eval_file_loaded;
+  if (evaluation != verified)
+  {
+      Eval::NNUE::verify();
+      verified = evaluation;
+  }
+
+  TT.new_search();
+
+  for (Thread* th : *this)
+  {
+      th->job = job;
+      th->start_searching();
+  }
+
+  constexpr TimePoint AgingInterval = 100;
+  TimePoint lastMonitor = now();
+
+  for (Thread* th : *this)
+      while (!th->wait_for_search_finished(AgingInterval))
+      {
+          if (TT.hashfull() >= 500)
+              TT.new_search();
+
+          if (monitor && now() - lastMonitor >= interval)
+          {
+              monitor();
+              lastMonitor = now();
+          }
+      }
+
+  Search::init(size());
+}
+
 Thread* ThreadPool::get_best_thread() const {
 
     Thread* bestThread = front();
@@ -21,6 +21,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -54,10 +55,21 @@ public:
   void idle_loop();
   void start_searching();
   void wait_for_search_finished();
+  bool wait_for_search_finished(TimePoint ms);
+  size_t id() const { return idx; }
+
+  // Independent single-threaded searches, used by the book workers
+  void search_position(const Variant* v, const std::string& fen, const Search::LimitsType& limits);
+  void check_worker_limits();
+
+  std::function<void(Thread&)> job;
+  bool worker = false, workerStop = false;
+  int workerCalls;
+  Search::LimitsType workerLimits;
 
   Pawns::Table pawnsTable;
   Material::Table materialTable;
-  size_t pvIdx, pvLast;
+  size_t pvIdx, pvLast, pvCount;
   uint64_t ttHitAverage;
   int selDepth, nmpMinPly;
   Color nmpColor;
@@ -67,6 +79,7 @@ public:
   StateInfo rootState;
   Search::RootMoves rootMoves;
   Depth rootDepth, completedDepth;
+  Value classifyThreshold, previousClassifyThreshold; // VALUE_NONE for exact scores
   CounterMoveHistory counterMoves;
   ButterflyHistory mainHistory;
   LowPlyHistory lowPlyHistory;
@@ -103,6 +116,8 @@ struct MainThread : public Thread {
 struct ThreadPool : public std::vector<Thread*> {
 
   void start_thinking(Position&, StateListPtr&, const Search::LimitsType&, bool = false);
+  void run_workers(const std::function<void(Thread&)>& job,
+                   const std::function<void()>& monitor = nullptr, TimePoint interval = 0);
   void clear();
   void set(size_t);
 
@@ -115,6 +130,7 @@ struct ThreadPool : public std::vector<Thread*> {
 
   std::atomic_bool stop, increaseDepth;
   std::atomic_bool abort, sit;
+  size_t pvSplit = 0; // Number of threads the MultiPV root moves are split among
 
   StateListPtr setupStates;
 
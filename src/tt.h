@@ -19,6 +19,8 @@
 #ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <atomic>
+
 #include "misc.h"
 #include "types.h"
 
@@ -81,6 +83,7 @@ class TranspositionTable {
 public:
  ~TranspositionTable() { aligned_large_pages_free(table); }
   void new_search() { generation8 += GENERATION_DELTA; } // Lower bits are used for other things
+  uint8_t generation() const { return generation8.load(std::memory_order_relaxed); }
   TTEntry* probe(const Key key, bool& found) const;
   int hashfull() const;
   void resize(size_t mbSize);
@@ -95,7 +98,9 @@ private:
 
   size_t clusterCount;
   Cluster* table;
-  uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
+  // Size must be not bigger than TTEntry::genBound8. Atomic, since the book
+  // workers keep searching while a new generation is started.
+  std::atomic<uint8_t> generation8;
 };
 
 extern TranspositionTable TT;
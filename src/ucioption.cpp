@@ -168,9 +168,22 @@ void init(OptionsMap& o) {
   o["AbsScoreRange"]         << Option(100, 0, 1000);
   o["AbsScoreBias"]          << Option(0, -1000, 1000);
   o["DepthFactor"]           << Option(100, 0, 200);
+  o["PrepassDepth"]          << Option(0, 0, 64);
+  o["PrepassMargin"]         << Option(200, 0, 1000);
+  o["FilterEvalRange"]       << Option(0, 0, 10000);
+  o["FilterShallowDepth"]    << Option(0, 0, 64);
+  o["FilterShallowMargin"]   << Option(50, 0, 1000);
   o["AbsMoveScore"]          << Option(false);
   o["TrimFEN"]               << Option(true);
   o["EPDPath"]               << Option("book.epd");
+  o["StreamEPD"]             << Option(false);
+  o["EPDAnnotations"]        << Option(false);
+  o["CheckpointPath"]        << Option("<empty>");
+  o["CheckpointInterval"]    << Option(600, 1, 86400);
+  o["ProgressInterval"]      << Option(60, 0, 86400);
+  o["AnalysisCache"]         << Option("<empty>");
+  o["BookMemory"]            << Option(0, 0, MaxHashMB);
+  o["SpillPath"]             << Option("<empty>");
   o["Contempt"]              << Option(24, -100, 100);
   o["Analysis Contempt"]     << Option("Both", {"Both", "Off", "White", "Black"});
   o["Threads"]               << Option(1, 1, 512, on_threads);
@@ -178,6 +191,7 @@ void init(OptionsMap& o) {
   o["Clear Hash"]            << Option(on_clear_hash);
   o["Ponder"]                << Option(false);
   o["MultiPV"]               << Option(1, 1, 500);
+  o["SplitMultiPV"]          << Option(false); // Only for "go", book commands search positions in parallel
   o["Skill Level"]           << Option(20, -20, 20);
   o["Move Overhead"]         << Option(10, 0, 5000);
   o["Slow Mover"]            << Option(100, 10, 1000);
@@ -1,6 +1,9 @@
 # -*- coding: utf-8 -*-
 
 import faulthandler
+import os
+import struct
+import tempfile
 import unittest
 import pyffish as sf
 
@@ -476,6 +479,20 @@ class TestPyffish(unittest.TestCase):
         result = sf.game_result("chess", CHESS, ["f2f3", "e7e5", "g2g4", "d8h4"])
         self.assertTrue(result < 0)
 
+    def test_evaluate(self):
+        result = sf.evaluate("chess", [CHESS, "rnb1kbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"])
+        self.assertEqual(len(result), 2)
+        # in centipawns
+        self.assertTrue(abs(result[0]) < 100)
+        self.assertTrue(500 < result[1] < 2000)
+
+        # in check
+        result = sf.evaluate("chess", ["rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3"])
+        self.assertEqual(result, [None])
+
+        result = sf.evaluate("crazyhouse", ["rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[Q] b KQkq - 0 1"])
+        self.assertTrue(-2000 < result[0] < -300)
+
     def test_is_immediate_game_end(self):
         result = sf.is_immediate_game_end("capablanca", CAPA, [])
         self.assertFalse(result[0])
@@ -506,5 +523,110 @@ class TestPyffish(unittest.TestCase):
                 self.assertTrue(sf.validate_fen(fen, variant) == 1, "{}: {}".format(variant, fen))
 
 
+def varint(v):
+    out = b""
+    while v >= 0x80:
+        out += bytes([v & 0x7F | 0x80])
+        v >>= 7
+    return out + bytes([v])
+
+
+def book_key(fen):
+    """FNV-1a hash of the FEN without move counters"""
+    h = 14695981039346656037
+    for c in " ".join(fen.split()[:4]).encode():
+        h = ((h ^ c) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+
+def write_book(path, variant, positions):
+    """Write a binary book with verbatim FENs, positions are (fen, moves with centipawn scores or None)"""
+    data = b"BGBOOK02" + struct.pack("<QQI", 0, 0, len(variant)) + variant.encode()
+    index = []
+    for fen, moves in positions:
+        key = book_key(fen)
+        note = b""
+        if moves is not None:
+            note = varint(10) + varint(1000) + varint(len(moves))
+            for move, score in moves:
+                note += varint(len(move)) + move.encode() + varint((score << 1 ^ score >> 31) & 0xFFFFFFFF)
+        index.append((key, len(data)))
+        data += varint(len(note)) + note + varint(len(fen) << 1) + fen.encode()
+    data += bytes(-len(data) % 8)
+    index_offset = len(data)
+    for key, offset in sorted(index):
+        data += struct.pack("<QQ", key, offset)
+    data = data[:8] + struct.pack("<QQ", len(index), index_offset) + data[24:]
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+class TestBook(unittest.TestCase):
+
+    def test_book(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "test.bgb")
+            e4 = "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq -"
+            write_book(path, "chess", [(CHESS, [("e2e4", 30), ("d2d4", -25)]), (e4, None)])
+
+            self.assertEqual(sf.book_size(path), 2)
+            positions = sorted(sf.book_position(path, i) for i in range(2))
+            self.assertEqual(positions, [(e4, []), (CHESS, [("e2e4", 30), ("d2d4", -25)])])
+            self.assertRaises(IndexError, sf.book_position, path, 2)
+
+            self.assertEqual(sf.book_lookup(path, CHESS), [("e2e4", 30), ("d2d4", -25)])
+            self.assertEqual(sf.book_lookup(path, e4 + " 0 1"), [])
+            self.assertIsNone(sf.book_lookup(path, "rnbqkbnr/pppppppp/8/8/3P4/8/PPP1PPPP/RNBQKBNR b KQkq - 0 1"))
+
+            with open(os.path.join(tmp, "invalid.bgb"), "wb") as f:
+                f.write(b"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1")
+            self.assertRaises(ValueError, sf.book_size, os.path.join(tmp, "invalid.bgb"))
+
+            # Offsets and lengths beyond the records are rejected
+            with open(path, "rb") as f:
+                data = bytearray(f.read())
+            index_offset = struct.unpack_from("<Q", data, 16)[0]
+            struct.pack_into("<Q", data, index_offset + 8, index_offset)
+            struct.pack_into("<Q", data, index_offset + 24, index_offset - 1)
+            data[index_offset - 1] = 0x80
+            with open(os.path.join(tmp, "corrupt.bgb"), "wb") as f:
+                f.write(data)
+            self.assertRaises(ValueError, sf.book_position, os.path.join(tmp, "corrupt.bgb"), 0)
+            self.assertRaises(ValueError, sf.book_position, os.path.join(tmp, "corrupt.bgb"), 1)
+
+            # A book rewritten in place is mapped again
+            write_book(path, "chess", [(e4, None)])
+            self.assertEqual(sf.book_size(path), 1)
+            self.assertIsNone(sf.book_lookup(path, CHESS))
+
+    def test_stream(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "test.bgs")
+            lines = [CHESS,
+                     "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1",
+                     "rnbqkbnr/pppppppp/8/8/3P4/8/PPP1PPPP/RNBQKBNR b KQkq - 0 1 ce 20; acd 10;",
+                     "# not a position",
+                     "rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq -"]
+            sf.write_stream(path, "chess", lines)
+            self.assertEqual(sf.read_stream(path), lines)
+            self.assertTrue(os.path.getsize(path) < sum(len(l) for l in lines))
+
+            # Records beyond the end of the file are rejected
+            with open(path, "rb") as f:
+                data = f.read()
+            with open(os.path.join(tmp, "truncated.bgs"), "wb") as f:
+                f.write(data[:-1])
+            self.assertRaises(ValueError, sf.read_stream, os.path.join(tmp, "truncated.bgs"))
+
+            path = os.path.join(tmp, "crazyhouse.bgs")
+            lines = ["rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[Q] b KQkq - 0 1",
+                     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] b KQkq - 0 1",
+                     "rnbqkb+r~/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] b KQkq - 0 1"]
+            sf.write_stream(path, "crazyhouse", lines)
+            self.assertEqual(sf.read_stream(path), lines)
+
+            self.assertRaises(ValueError, sf.read_stream, os.path.join(tmp, "test.bgb"))
+
+
 if __name__ == '__main__':
     unittest.main(verbosity=2)
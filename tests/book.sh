@@ -0,0 +1,51 @@
+#!/bin/bash
+# verify book generation
+
+error()
+{
+  echo "book testing failed on line $1"
+  exit 1
+}
+trap 'error ${LINENO}' ERR
+
+echo "book testing started"
+
+# the shards of a perft book should be roughly balanced
+for i in 0 1 2 3
+do
+  printf "setoption name StreamEPD value true\nsetoption name EPDPath value shard$i.epd\ngenerate 4 perft shard $i/4\nquit\n" | ./bookgen > /dev/null
+done
+wc -l shard0.epd shard1.epd shard2.epd shard3.epd | awk '$2 != "total" {n[NR] = $1; sum += $1}
+  END {for (i in n) if (n[i] < sum / 8 || n[i] > sum * 3 / 8) exit(1)}'
+
+rm shard0.epd shard1.epd shard2.epd shard3.epd
+
+# spilled runs are merged in passes within a small file descriptor limit
+(ulimit -n 64; printf "setoption name BookMemory value 1\nsetoption name StreamEPD value true\nsetoption name EPDPath value spill.epd\ngenerate 5 perft\nquit\n" | ./bookgen > /dev/null)
+test $(wc -l < spill.epd) -eq 822518
+
+rm spill.epd
+
+# a resumed filter keeps the annotations of the positions accepted before the interruption
+cat << EOF > resume.in
+setoption name EPDAnnotations value true
+setoption name EPDPath value resume.epd
+setoption name CheckpointPath value resume.ckpt
+setoption name CheckpointInterval value 1
+generate 2 perft
+filter nodes 10000
+EOF
+
+./bookgen < resume.in > /dev/null &
+pid=$!
+while ! grep -q "^decisions" resume.ckpt 2> /dev/null; do sleep 0.1; done
+kill $pid
+wait $pid || true
+grep -q "^analysis" resume.ckpt
+printf "resume resume.ckpt\nsave\nquit\n" | ./bookgen > /dev/null
+test -s resume.epd
+test $(grep -vc " ce .* mpv " resume.epd) -eq 0
+
+rm -f resume.in resume.ckpt resume.epd
+
+echo "book testing OK"